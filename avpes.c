@@ -13,7 +13,7 @@
 // 3) zero-out a file and delete it. This irreversibly destroys all data
 // contained within the file.
 //
-// 4) encrypt/decrypt data to/from an uncompressed 24-bit bitmap file
+// 4) encrypt/decrypt data to/from an uncompressed 24- or 32-bit bitmap file
 
 // usage examples:
 // avpes --encdef myfile.txt
@@ -22,21 +22,53 @@
 // avpes --encvig myfile.txt mykey.txt
 // avpes --decvig myfile.txt mykey.txt
 //
+// avpes --encdef myfile.txt --compress
+// avpes --decdef encrypted_myfile.txt keymap_myfile.txt --compress
+//
+// avpes --encvig myfile.txt mykey.txt --in-place
+//
 // avpes --zero myfile.txt
+// avpes --zero myfile.txt --resume
+//
+// avpes --encdef myfile.txt --keymap-dir /mnt/usb
+// avpes --encdef myfile.txt --stripe-enc /mnt/a,/mnt/b --stripe-key /mnt/c,/mnt/d
+//
+// avpes --serve /tmp/avpes.sock --workers 8
+// avpes --submit /tmp/avpes.sock --encvig myfile.txt mykey.txt
 //
 // avpes --encbmp myimage.bmp mydata.dat
 // avpes --decbmp myimage.bmp 1000
+// avpes --bmpinfo myimage.bmp
+//
+// avpes --chain compress,encvig:mykey.txt,encbmp:myimage.bmp mydata.dat
+// avpes --chain decbmp:1000,decvig:mykey.txt,decompress encrypted_myimage.bmp
 //
 // if you're a a recruiter or something, STOP! DO NOT GO FORWARD.
 // (in case if you do, i'm better than this now. Much much better. I promise.)
 
+#define _GNU_SOURCE // fdatasync, ftruncate and friends
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include <sodium.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 typedef uint32_t DWORD; // 4 bytes, unsigned
 typedef int32_t  LONG; // 4 bytes, signed
@@ -44,6 +76,218 @@ typedef uint16_t WORD; // 2 bytes, unsigned
 
 typedef unsigned char uchar8;
 typedef unsigned long uint32;
+
+#define CHUNK_SIZE  65536 // bytes handled per read/xor/write round
+#define FRAME_HEAD  8 // stored size + raw size of every packed chunk
+#define RAW_CHUNK   0x80000000UL // stored size flag: chunk didn't compress
+#define LZ_HASHLOG  12
+#define CKPT_EVERY  (64UL << 20) // input bytes between two checkpoints
+#define CKPT_TAIL   4096 // bytes before the checkpoint that get hashed
+#define IP_BLOCK    (4UL << 20) // --in-place rewrites (and journals) this much at once
+#define JOB_LINE    8192 // longest --serve request
+#define JOB_QUEUE   256 // connections waiting for a worker
+#define STRIPE_UNIT (1UL << 20) // striped outputs go round-robin in units this big
+#define STRIPE_DEPTH 4 // units queued per shard thread
+#define STRIPE_MAX  16
+#define STRIPE_MAGIC "AVPES stripes 1\n"
+#define CHAIN_MAX   8 // stages in one --chain
+#define CACHE_WINDOW (8UL << 20) // page cache hints are given per window this big
+#define DIRECT_ALIGN 4096 // O_DIRECT offsets, sizes and buffers line up on this
+#define DIRECT_BUF  (1UL << 20) // --direct reads this much at once
+#define KEY_STAMP   6 // numbers that tell a cached key file has changed
+#define KEY_CACHE   64 // keys the daemon keeps, least recently used go first
+#define POOL_CACHED 2 // bufGet/bufPut: owned by the key cache, not by a job
+#define POOL_LOCKED 4 // with POOL_CACHED: locked into RAM
+#define POOL_SHIFT  12 // smallest pool class is 4K, the next ones double
+#define POOL_POW2   20 // power of two classes, 4K up to 2G
+#define POOL_CLASSES (POOL_POW2 + 2) // + XOR_BLOCK and PACK_BLOCK
+#define XOR_BLOCK   (2 * CHUNK_SIZE + FRAME_HEAD) // data + keystream scratch
+#define PACK_BLOCK  (3 * CHUNK_SIZE + 2 * FRAME_HEAD) // data + frame + scratch
+
+enum { KS_RANDOM, KS_KEYMAP, KS_VIG, KS_NONE }; // where the XOR bytes come from
+enum { CH_COMPRESS, CH_ENCDEF, CH_ENCVIG, CH_ENCBMP, // --chain stages, the
+       CH_DECBMP, CH_DECDEF, CH_DECVIG, CH_DECOMPRESS }; // decrypting ones last
+
+typedef struct
+{
+    int kind;
+    FILE *keymap; // written by KS_RANDOM, read by KS_KEYMAP
+    uchar8 *vkey; // letters of the vigenere key file
+    uint32 vlen;
+    uint32 vpos;
+    uchar8 *scratch; // CHUNK_SIZE + FRAME_HEAD bytes
+    uint32 vsize; // bytes allocated for vkey
+} KEYSTREAM;
+
+typedef struct
+{
+    char *name; // journal_<input>
+    const char *mode;
+    uint32 insize;
+    long long stamp; // mtime of the input, 0 if it isn't checked
+    FILE *outs[2]; // files that must be durable before a checkpoint
+    int nouts;
+    int keep; // don't truncate outputs on resume (zeroing works in place)
+    uint32 inOff; // last committed offsets
+    uint32 outOff;
+    unsigned long long tail[2]; // hashes of the outputs before outOff
+} JOURNAL;
+
+typedef struct VIGKEY // a preprocessed key, cached by the daemon
+{
+    char *name;
+    long long stamp[KEY_STAMP]; // see keyStamp
+    int flags; // POOL_CACHED, maybe POOL_LOCKED
+    unsigned long long used; // keycache.tick of the last hit
+    uchar8 *key;
+    uint32 len;
+    struct VIGKEY *next;
+} VIGKEY;
+
+typedef struct STRIPE STRIPE;
+
+typedef struct // one shard file of a striped output, with its own I/O thread
+{
+    STRIPE *set;
+    int index;
+    FILE *fl;
+    char *path;
+    pthread_t tid;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uchar8 *bufs[STRIPE_DEPTH]; // ring of full units (writing: waiting to be
+    uint32 lens[STRIPE_DEPTH];  // written, reading: read ahead)
+    int head;
+    int count;
+    int done; // writing: no more units coming; reading: end of shard
+    int stop; // reading: we're closing, stop reading ahead
+    int error;
+} SHARD;
+
+struct STRIPE
+{
+    int writing;
+    int failed; // the job didn't finish, don't write the layout file
+    int n;
+    uint32 unit;
+    uint32 size; // total bytes (reading) / bytes so far (writing)
+    uint32 pos;
+    uint32 first; // where reading started
+    int started;
+    char *name; // the layout file
+    uchar8 *cur; // unit being filled (writing) or drained (reading)
+    uint32 curlen;
+    uint32 curoff;
+    SHARD shards[STRIPE_MAX];
+};
+
+// per thread, so every daemon job gets its own set
+static _Thread_local struct
+{
+    int compress; // --compress: lz4 stage before the XOR
+    int resume; // --resume: continue from journal_<file>
+    int inplace; // --in-place: overwrite the file instead of writing a new one
+    int workers; // --workers: size of the --serve thread pool
+    const char *keymapDir; // --keymap-dir: where keymap_<file> goes
+    const char *stripeEnc; // --stripe-enc: comma separated shard directories
+    const char *stripeKey; // --stripe-key: same for the keymap
+    int quiet; // no progress output (daemon jobs)
+    uint32 maxRate; // --max-rate: bytes per second read and written, 0 = no limit
+    uint32 maxIops; // --max-iops: reads and writes per second
+    int nocache; // --no-cache: drop what we're done with from the page cache
+    int direct; // --direct: read inputs with O_DIRECT
+    int idle; // --idle: idle I/O class and lowest CPU priority
+    uint32 maxMemory; // --max-memory: cap for all buffers of the process
+    int lockKeys; // --lock-keys: key material stays in RAM (sodium_mlock)
+} opts;
+
+// every I/O and keystream buffer comes from here. buffers go back to a
+// free list per size class when they're returned, so a process (or a
+// daemon running job after job) only allocates as much as it ever held at
+// once. the classes are fixed (see poolClass), so keys and bitmap rows of
+// every size share them and never crowd out the engine blocks.
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    uint32 cap; // --max-memory, 0 = no limit
+    uint32 used; // handed out + kept for reuse
+    int holders; // threads holding buffers
+    int waiting; // how many of them are waiting for more
+    unsigned gen; // bumped whenever buffers come back
+    uchar8 *free[2][POOL_CLASSES]; // [locked][class], linked through each buffer
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0, 
+            { { NULL } } };
+
+static _Thread_local uint32 held; // pool bytes this thread holds
+
+// --max-rate / --max-iops token buckets, per thread like opts
+static _Thread_local struct
+{
+    double bytes;
+    double ios;
+    double last; // when they were topped up, 0 = not started
+} bucket;
+
+typedef struct // a bitmap being filled (embedding) or read out (extracting)
+{
+    FILE *bmp; // at the next pixel row
+    FILE *out; // the new image, embedding only
+    uint32 infosize; // biSize, tells the header version apart
+    uint32 width;
+    uint32 pixel; // bytes per pixel, 3 or 4
+    int alpha; // byte of a pixel that's left alone, -1 = none
+    int topdown; // negative biHeight, rows are stored top to bottom
+    uint32 offset; // bfOffBits, where the pixel rows start
+    uint32 rowbytes; // pixel bytes per row
+    uint32 padding;
+    uint32 rows; // rows not loaded yet
+    uchar8 *row; // the current row, padding included
+    uint32 rowpos; // next usable byte in it
+    int loaded;
+    uint32 capacity; // data bytes that fit into the image
+    uint32 count; // data bytes embedded / extracted so far
+} BMPSTREAM;
+
+typedef struct
+{
+    int kind;
+    const char *arg; // key file, carrier image, byte count...
+} CHAINSTAGE;
+
+typedef struct // one --chain stage, a FILE * in front of the next one
+{
+    FILE *next; // where the data goes (writing) or comes from (reading)
+    KEYSTREAM ks;
+    uchar8 *buf;
+    int isBmp;
+    BMPSTREAM bmp;
+    uint32 left; // bytes still to extract from the bitmap
+    uint32 *count; // gets bmp.count on close
+} CHAINLINK;
+
+#ifndef _WIN32
+typedef struct // a --direct input
+{
+    int fd;
+    uchar8 *buf; // DIRECT_BUF bytes, DIRECT_ALIGN aligned
+    off64_t bufoff; // file offset of buf[0]
+    size_t buflen;
+    off64_t pos;
+} DIRECTIN;
+#endif
+
+static struct
+{
+    int enabled;
+    pthread_mutex_t lock;
+    VIGKEY *keys;
+    unsigned long long tick;
+} keycache = { 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+void parseOpts(int *, char *[]);
+int checkOpts(const char *); // options that don't go with this mode
 void encDef(const char *); // default encryption
 void encVig(const char *, const char *); // vigenere-like encryption
 void decDef(const char *, const char *); // default decryption
@@ -54,7 +298,66 @@ uint32 fileSize(FILE *); // spits out filesize
 uint32 progress(uint32, uint32, uint32); // percentage
 void zero(const char *, const uint32); // zeroes out a file completely
 void ask(const char *, const uint32);
-void byteFormat(uchar8 *, uchar8);
+int loadVigKey(KEYSTREAM *, FILE *, const char *); // letters of the key file
+void freeVigKey(KEYSTREAM *);
+int keyXor(KEYSTREAM *, uchar8 *, uint32);
+int xorStream(FILE *, FILE *, KEYSTREAM *, uint32, JOURNAL *);
+int packStream(FILE *, FILE *, KEYSTREAM *, uint32, JOURNAL *); // compress, then XOR
+int unpackStream(FILE *, FILE *, KEYSTREAM *, uint32, JOURNAL *); // XOR, then decompress
+int putFrame(FILE *, KEYSTREAM *, uchar8 *, uint32);
+int getFrame(FILE *, KEYSTREAM *, uchar8 *, uint32);
+void put32(uchar8 *, uint32);
+uint32 get32(const uchar8 *);
+int lz4Compress(const uchar8 *, int, uchar8 *, int);
+int lz4Sequence(uchar8 *, int *, int, const uchar8 *, int, int, int);
+int lz4Decompress(const uchar8 *, int, uchar8 *, int);
+int openJournal(JOURNAL *, const char *, const char *, uint32, long long);
+int resumeOutputs(JOURNAL *); // checks and rewinds outputs to the journal
+int checkpoint(JOURNAL *, uint32, uint32, int);
+void closeJournal(JOURNAL *, int);
+unsigned long long tailHash(FILE *, uint32);
+long long fileStamp(const char *);
+int syncFile(FILE *);
+int syncDir(const char *); // the directory the file is in
+FILE *replaceBegin(const char *, char **); // crash-safe rewrite of a small file
+int replaceEnd(FILE *, char *, const char *);
+int truncFile(FILE *, uint32);
+int runEncDef(const char *);
+int runEncVig(const char *, const char *);
+int runDecDef(const char *, const char *);
+int runDecVig(const char *, const char *);
+int runJob(int, char *[]); // one daemon request
+char *prefixName(const char *, const char *); // dir/prefix_file for dir/file
+uint32 pathSize(const char *);
+int keyStamp(FILE *, long long *);
+int cachedVigKey(const char *, const long long *, uchar8 *, uint32 *);
+void storeVigKey(const char *, const long long *, const uchar8 *, uint32);
+int serve(const char *); // --serve
+int submit(int, char *[]); // --submit
+char *keymapName(const char *);
+FILE *openOutput(const char *, const char *, STRIPE **); // plain or striped
+FILE *openInput(const char *); // follows layout files to their shards
+int isLayout(const char *);
+int vigInPlace(const char *, KEYSTREAM *, const char *);
+int journalBlock(const char *, const char *, uint32, uint32, uint32, uint32, const uchar8 *);
+int replayBlock(const char *, const char *, FILE *, uint32, uchar8 *, uint32 *);
+unsigned long long fnv64(const uchar8 *, size_t);
+void chain(const char *, const char *); // --chain
+int runChain(const char *, const char *, uint32 *);
+int parseChain(char *, CHAINSTAGE *);
+int openBmp(BMPSTREAM *, const char *, const char *);
+int bmpLayout(FILE *, const char *, BMPSTREAM *); // headers only
+void bmpInfo(const char *); // --bmpinfo
+FILE *openRead(const char *); // input file, with --direct and readahead hints
+void ioPace(FILE *, uint32, int); // throttling and page cache hints per I/O
+void ioDone(FILE *);
+void idlePriority(void);
+uint32 parseSize(const char *);
+uchar8 *bufGet(size_t, int); // buffer from the pool, 1 = key material
+void bufPut(uchar8 *, size_t, int);
+int bmpPut(BMPSTREAM *, const uchar8 *, uint32); // embed data bytes
+int bmpGet(BMPSTREAM *, uchar8 *, uint32); // extract them
+int bmpClose(BMPSTREAM *, int);
 
 #pragma pack(push, 1) // disabling structure padding
 typedef struct
@@ -86,7 +389,19 @@ BITMAPINFOHEADER;
 
 int main(int argc, char *argv[])
 {
-    if(strcmp(argv[1], "--encdef") == 0)
+    if(argc > 1 && strcmp(argv[1], "--submit") == 0) // options go along as is
+        return submit(argc, argv);
+
+    parseOpts(&argc, argv);
+    const char *mode = argc > 1 ? argv[1] : ""; // none = usage
+    int status = argc > 1 ? checkOpts(mode) : 0;
+    if(status != 0)
+        exit(status);
+    if(opts.idle) // daemon workers inherit it from here
+        idlePriority();
+    pool.cap = opts.maxMemory; // one pool for the whole process
+
+    if(strcmp(mode, "--encdef") == 0)
     {
         if(argc != 3)
 		{
@@ -96,7 +411,7 @@ int main(int argc, char *argv[])
 		else
             encDef(argv[2]);
     }
-    else if (strcmp(argv[1], "--encvig") == 0)
+    else if (strcmp(mode, "--encvig") == 0)
     {
         if(argc != 4)
 		{
@@ -106,7 +421,7 @@ int main(int argc, char *argv[])
 		else
             encVig(argv[2], argv[3]);
     }
-    else if(strcmp(argv[1], "--decdef") == 0)
+    else if(strcmp(mode, "--decdef") == 0)
     {
 		if(argc != 4)
 		{
@@ -116,7 +431,7 @@ int main(int argc, char *argv[])
 		else
 			decDef(argv[2], argv[3]);
     }
-    else if(strcmp(argv[1], "--decvig") == 0)
+    else if(strcmp(mode, "--decvig") == 0)
     {
 		if(argc != 4)
 		{
@@ -126,7 +441,7 @@ int main(int argc, char *argv[])
 		else
 			decVig(argv[2], argv[3]);
     }
-    else if(strcmp(argv[1], "--encbmp") == 0)
+    else if(strcmp(mode, "--encbmp") == 0)
     {
         if(argc != 4)
         {
@@ -136,7 +451,7 @@ int main(int argc, char *argv[])
         else
             encBmp(argv[2], argv[3]);
     }
-    else if(strcmp(argv[1], "--decbmp") == 0)
+    else if(strcmp(mode, "--decbmp") == 0)
     {
         if(argc != 4)
         {
@@ -150,7 +465,37 @@ int main(int argc, char *argv[])
             decBmp(argv[2], num);
         }
     }
-    else if(strcmp(argv[1], "--zero") == 0)
+    else if(strcmp(mode, "--bmpinfo") == 0)
+    {
+        if(argc != 3)
+        {
+            printf("Error: Must have two arguments.\n");
+            exit(-73);
+        }
+        else
+            bmpInfo(argv[2]);
+    }
+    else if(strcmp(mode, "--chain") == 0)
+    {
+        if(argc != 4)
+        {
+            printf("Error: Must have three arguments.\n");
+            exit(-72);
+        }
+        else
+            chain(argv[2], argv[3]);
+    }
+    else if(strcmp(mode, "--serve") == 0)
+    {
+        if(argc != 3)
+        {
+            printf("Error: Must have two arguments.\n");
+            exit(-71);
+        }
+        else
+            exit(serve(argv[2]));
+    }
+    else if(strcmp(mode, "--zero") == 0)
     {
         if(argc != 3)
         {
@@ -177,15 +522,29 @@ int main(int argc, char *argv[])
     }
     else
     {
-        printf("%s%s%s%s%s%s%s%s",
-        "Usage: avpes [mode] [file] [additional input (optional)]\n\t",
+        printf("%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s",
+        "Usage: avpes [mode] [file] [additional input (optional)] [options]\n\t",
         "Modes:\n\n\t\t--encdef = default encryption\n\t\t",
         "--encvig = vigenere encryption (requires ASCII text file containing key)\n\t\t",
         "--decdef = default decryption (requires keymap file)\n\t\t",
         "--decvig = vigenere decryption (requires ASCII text file containing key)\n\t\t",
         "--zero   = zero-out mode; give it a filename and it will destroy its data.\n\t\t",
-        "--encbmp = encode data of a file into the specified bitmap image.\n\t\t"
-        "--decbmp = extract data from a bitmap image. Third argument should be the number of bytes to extract.\n");
+        "--encbmp = encode data of a file into the specified bitmap image.\n\t\t",
+        "--decbmp = extract data from a bitmap image. Third argument should be the number of bytes to extract.\n\t\t",
+        "--bmpinfo = show a bitmap's layout and how many bytes it can hold, without touching the pixels.\n\t\t",
+        "--chain  = run stages in one pass, e.g. compress,encvig:key.txt,encbmp:carrier.bmp (see README)\n\t\t",
+        "--serve  = run as a daemon on the given unix socket and take --encdef/--decdef/--encvig/--decvig jobs.\n\t\t",
+        "--submit = send a job to a daemon: avpes --submit [socket] [mode] [file] [additional input] [options]\n\t",
+        "Options:\n\n\t\t",
+        "--compress = compress before encrypting (pass it when decrypting too)\n\t\t",
+        "--resume   = continue an --encdef, --decdef, --zero or --in-place run that got interrupted\n\t\t",
+        "--in-place = --encvig/--decvig overwrite the file itself instead of making a copy\n\t\t",
+        "--workers  = number of threads for --serve (default: one per CPU)\n\t\t",
+        "--keymap-dir = put the --encdef keymap into this directory\n\t\t",
+        "--stripe-enc / --stripe-key = spread the encrypted file / keymap over these directories (comma separated)\n\t\t",
+        "--max-rate / --max-iops = limit reads+writes to this many bytes (K/M/G) / operations per second\n\t\t",
+        "--no-cache / --direct / --idle = keep out of the page cache / read with O_DIRECT / run at idle priority\n\t\t",
+        "--max-memory = cap for all buffers (K/M/G), --lock-keys = keep key material out of swap\n");
         exit(-99);
     }
 
@@ -194,94 +553,198 @@ int main(int argc, char *argv[])
 
 void encDef(const char *fname)
 {
-    if(sodium_init() != 0)
+    int status = runEncDef(fname);
+    if(status != 0)
+        exit(status);
+
+    char *outname       = keymapName(fname);
+    char *encoutname    = prefixName("encrypted_", fname);
+	printf("\rEncryption completed.             \nEncrypted file: %s\n", encoutname);
+    printf("Keymap file: %s\n", outname);
+    free(outname);
+    free(encoutname);
+	ask(fname, pathSize(fname));
+}
+
+void encVig(const char *fname, const char *keyname) // encode using vigenere cipher
+{
+    int status = runEncVig(fname, keyname);
+    if(status != 0)
+        exit(status);
+
+    if(opts.inplace) // nothing to shred afterwards, the plaintext is gone
     {
-        printf("Error initializing sodium.\n");
-        exit(-8);
+        printf("\r%s has been encrypted in place.           \n", fname);
+        printf("All done.\n");
+        return;
     }
+    printf("\rEncryption completed.                   \n");
+    ask(fname, pathSize(fname));
+}
 
-    // cipherfile filename preparations
-    char *outname       = (char *) calloc(strlen(fname) + strlen("keymap_") + 1, 
-                        sizeof(char));
-    char *encoutname    = (char *) calloc(strlen(fname) + strlen("encrypted_") + 1, 
-                        sizeof(char));
-    strcpy(outname, "keymap_");
-	strcat(outname, fname);
-    strcpy(encoutname, "encrypted_");
-    strcat(encoutname, fname);
+void decDef(const char *fname, const char *keyname) //default decode
+{
+    int status = runDecDef(fname, keyname);
+    if(status != 0)
+        exit(status);
+
+    char *resultName = prefixName("decrypted_", fname);
+    printf("\rFile decrypted successfully.           \nDecrypted file: %s\n", 
+            resultName);
+    free(resultName);
+	
+    char usrInpt;
+	printf("Delete encrypted file (%s)? (Y/N) ", fname);
+    fflush(stdout);
+	usrInpt = getchar();
+	if(usrInpt == 'y' || usrInpt == 'Y')
+		remove(fname);
+	fflush(stdin);
+	printf("Delete keymap file (%s)? (Y/N) ", keyname);
+    fflush(stdout);
+	usrInpt = getchar();
+	if(usrInpt == 'y' || usrInpt == 'Y')
+		remove(keyname);
+    printf("All done.\n");
+}
+
+void decVig(const char *fname, const char *keyname) //decode using vigenere cypher
+{
+    int status = runDecVig(fname, keyname);
+    if(status != 0)
+        exit(status);
+
+    char usrInpt;
+    if(opts.inplace)
+        printf("\r%s has been decrypted in place.           \n", fname);
+    else
+    {
+        printf("\rFile decrypted successfully.             \n");
+        printf("Delete the encrypted file (%s)? (Y/N) ", fname);
+        fflush(stdout);
+        usrInpt = getchar();
+        if(usrInpt == 'y' || usrInpt == 'Y')
+            remove(fname);
+        fflush(stdin);
+    }
+    printf("Would you like to delete the key file as well (%s)? (Y/N) ", keyname);
+    fflush(stdout);
+    usrInpt = getchar();
+    if(usrInpt == 'y' || usrInpt == 'Y')
+        remove(keyname);
+    printf("\nAll done.\n");
+}
+
+// the run* functions do the actual work of a mode without asking anything
+// or exiting, so the daemon can call them too. 0 means success, anything
+// else is the error code the command line version exits with.
+int runEncDef(const char *fname)
+{
+    if(sodium_init() < 0) // 1 just means it's been initialized before
+    {
+        printf("Error initializing sodium.\n");
+        return -8;
+    }
 
     // prepping plaintext and ciphertext files
-    FILE *plainfile = fopen(fname, "rb");
+    FILE *plainfile = openRead(fname);
     if(!plainfile)
     {
-        free(outname);
         printf("Error: File not found.\n");
-        exit(-98);
+        return -98;
     }
 
-    FILE *readyfile = fopen(encoutname, "wb");
-    if(!readyfile)
+    // an unfinished run leaves journal_<fname> behind; refuse to clobber
+    // its outputs unless we were asked to pick up where it stopped.
+    // striped outputs aren't journaled: their layout file is only written
+    // once every shard is complete, so a missing one marks them unfinished
+    const uint32 filesize   = fileSize(plainfile);
+    const int striped       = opts.stripeEnc || opts.stripeKey;
+    JOURNAL jn;
+    memset(&jn, 0, sizeof(jn));
+    int resumed = striped ? 0 
+                : openJournal(&jn, opts.compress ? "encdef+z" : "encdef", 
+                              fname, filesize, fileStamp(fname));
+    if(resumed < 0)
     {
-        free(outname);
-		free(encoutname);
         fclose(plainfile);
-        printf("Error: Encrypted file couldn't be created.\n");
-        exit(-97);
+        return resumed;
     }
 
-    FILE *cypherfile = fopen(outname, "wb");
-    if(!cypherfile)
+    // cipherfile filename preparations
+    char *outname       = keymapName(fname);
+    char *encoutname    = prefixName("encrypted_", fname);
+    STRIPE *encset      = NULL;
+    STRIPE *keyset      = NULL;
+    FILE *readyfile     = resumed ? fopen(encoutname, "r+b") 
+                        : openOutput(encoutname, opts.stripeEnc, &encset);
+    FILE *cypherfile    = !readyfile ? NULL : resumed ? fopen(outname, "r+b") 
+                        : openOutput(outname, opts.stripeKey, &keyset);
+    free(outname);
+    free(encoutname);
+    if(!readyfile || !cypherfile)
     {
-        free(outname);
-		free(encoutname);
+        printf("Error: %s file couldn't be created.\n", 
+                readyfile ? "keymap" : "Encrypted");
+        if(encset)
+            encset->failed = 1;
+        if(readyfile)
+            fclose(readyfile);
         fclose(plainfile);
-		fclose(readyfile);
-        printf("Error: keymap file couldn't be created.\n");
-        exit(-97);
+        free(jn.name);
+        return -97;
     }
     
-    const uint32 filesize   = fileSize(plainfile);
-    uchar8 buffer           = 0;
-    uchar8 key              = 0;
-	uint32 speed            = 0; 
-    uint32 unix             = (uint32) time(NULL);
-
-	printf("Progress: [00.00%%]");
-	fflush(stdout);
+    KEYSTREAM ks            = { KS_RANDOM, cypherfile, NULL, 0, 0, NULL, 0 };
+    int status              = 0;
+
+    jn.outs[0] = readyfile;
+    jn.outs[1] = cypherfile;
+    jn.nouts = 2;
+    // no RNG state is kept: the keymap up to the checkpoint already is the
+    // pad for the committed bytes and everything after it gets fresh random
+    // numbers, so the result is still a proper one-time pad
+    if(resumed)
+        status = resumeOutputs(&jn);
+    else if(!striped)
+        status = checkpoint(&jn, 0, 0, 1);
+    fseek(plainfile, jn.inOff, SEEK_SET);
+
+    if(!opts.quiet)
+        printf("Progress: [00.00%%]");
+    fflush(stdout);
 
     // actual encryption happens here :3
-    for(uint32 i = 1; i <= filesize; i++)
-    {
-        fread(&buffer, 1, 1, plainfile);
-        key = randombytes_random();
-        buffer = buffer ^ key; // XOR current byte with a random number
-        fwrite(&buffer, 1, 1, readyfile); // write encrypted byte to the file
-        fwrite(&key, 1, 1, cypherfile); // write random number to the keymap file
-        speed++;
-		if(unix < ((uint32) time(NULL)))
-        {
-			unix = progress((uint32) i, filesize, speed);
-            speed = 0;
-        }
-    }
-
+    // (every byte is XORed with a random number that goes to the keymap)
+    if(status == 0 && opts.compress)
+        status = packStream(plainfile, readyfile, &ks, filesize, 
+                            striped ? NULL : &jn);
+    else if(status == 0)
+        status = xorStream(plainfile, readyfile, &ks, filesize, 
+                            striped ? NULL : &jn);
+    if(!striped)
+        closeJournal(&jn, status == 0);
+
+    // closing a striped output waits for its shards and writes the layout
+    if(status != 0 && keyset)
+        keyset->failed = 1;
     fclose(plainfile);
-    fclose(cypherfile);
-    fclose(readyfile);
-	printf("\rEncryption completed.             \nEncrypted file: %s\n", encoutname);
-    printf("Keymap file: %s\n", outname);
-    free(outname);
-    free(encoutname);
-	ask(fname, filesize);
+    if(fclose(cypherfile) != 0 && status == 0)
+        status = -96;
+    if(status != 0 && encset)
+        encset->failed = 1;
+    if(fclose(readyfile) != 0 && status == 0)
+        status = -96;
+    return status;
 }
 
-void encVig(const char *fname, const char *keyname) // encode using vigenere cipher
+int runEncVig(const char *fname, const char *keyname)
 {
-	FILE *ufl = fopen(fname, "rb");
+	FILE *ufl = openRead(fname);
     if(!ufl)
     {
         printf("Unable to open file %s. Does it exist?\n", fname);
-        exit(-64);
+        return -64;
     }
     
     FILE *keyfl = fopen(keyname, "rb");
@@ -289,97 +752,82 @@ void encVig(const char *fname, const char *keyname) // encode using vigenere cip
     {
         printf("Error opening your cipher file (%s).\n", keyname);
         fclose(ufl);
-        exit(-29);
+        return -29;
     }
 
-    char *outname = calloc(strlen(fname) + strlen("encrypted_") + 1, sizeof(char));
-    strcpy(outname, "encrypted_");
-    strcat(outname, fname);
-    
-    FILE *efl = fopen(outname, "wb");
+    KEYSTREAM ks        = { KS_VIG, NULL, NULL, 0, 0, NULL, 0 };
+    int status          = 0;
+
+    status = loadVigKey(&ks, keyfl, keyname);
+    fclose(keyfl);
+    if(status != 0)
+    {
+        fclose(ufl);
+        return status;
+    }
+    if(ks.vlen == 0)
+    {
+        printf("Your key file (%s) doesn't contain any letters.\n", keyname);
+        freeVigKey(&ks);
+        fclose(ufl);
+        return -28;
+    }
+
+    if(opts.inplace)
+    {
+        fclose(ufl);
+        status = vigInPlace(fname, &ks, "encvig");
+        freeVigKey(&ks);
+        return status;
+    }
+
+    char *outname = prefixName("encrypted_", fname);
+    STRIPE *encset = NULL;
+    FILE *efl = openOutput(outname, opts.stripeEnc, &encset);
     if(!efl)
     {
         printf("Unable to create encrypted file (%s).\n", outname);
         free(outname);
+        freeVigKey(&ks);
         fclose(ufl);
-        fclose(keyfl);
+        return -65;
     }
+    free(outname);
     
     uint32 uflSize      = fileSize(ufl);
-    uint32 keySize      = fileSize(keyfl);
-    uint32 speed        = 0;
-    uint32 unix         = (uint32) time(NULL);
-    uchar8 byteFile     = 0x0;
-    uchar8 byteCipher   = 0x0;
-    uchar8 byteEnc      = 0x0;
-
-    for(uint32 i = 1, curpos = 0; i <= uflSize; i++)
-    {
-        fread(&byteFile, 1, 1, ufl);
-        do{
-            if(ftell(keyfl) == keySize)
-                fseek(keyfl, 0, SEEK_SET);
-            fscanf(keyfl, "%c", &byteCipher);
-        }while(isalpha(byteCipher) == 0);
-        
-        byteEnc = byteFile ^ byteCipher;
-        fwrite(&byteEnc, 1, 1, efl);
-
-        speed++;
-        if(unix < (uint32) time(NULL))
-        {
-            unix = progress(i, uflSize, speed);
-            speed = 0;
-        }
-    }
+    if(opts.compress)
+        status = packStream(ufl, efl, &ks, uflSize, NULL);
+    else
+        status = xorStream(ufl, efl, &ks, uflSize, NULL);
 
+    if(status != 0 && encset)
+        encset->failed = 1;
     fclose(ufl);
-    fclose(keyfl);
-    fclose(efl);
-    free(outname);
-    printf("\rEncryption completed.                   \n");
-    ask(fname, uflSize);
+    if(fclose(efl) != 0 && status == 0)
+        status = -96;
+    freeVigKey(&ks);
+    return status;
 }
 
-void decDef(const char *fname, const char *keyname) //default decode
+int runDecDef(const char *fname, const char *keyname)
 {
-    FILE *encryptedFile = fopen(fname, "rb");
+    FILE *encryptedFile = openInput(fname);
     if(!encryptedFile)
     {
         printf("Couldn't open file for decryption. Does it exist?\n");
-        exit(-32);
+        return -32;
     }
-    FILE *keymapFile = fopen(keyname, "rb");
+    FILE *keymapFile = openInput(keyname);
     if(!keymapFile)
     {
         fclose(encryptedFile);
         printf("Couldn't open keymap file for decryption. Does it exist?\n");
-        exit(-31);
+        return -31;
     }
 
-    //preparing decrypted filename
-    char *resultName =  (char *) calloc(strlen(fname) + strlen("decrypted_") + 1, 
-                        sizeof(char));
-    strcpy(resultName, "decrypted_");
-    strcat(resultName, fname);
-
-    FILE *decryptedFile = fopen(resultName, "wb");
-    if(!decryptedFile)
-    {
-        fclose(encryptedFile);
-        fclose(keymapFile);
-        free(resultName);
-        printf("Couldn't create decrypted file.\n");
-        exit(-30);
-    }
- 
     const uint32 encFile    = fileSize(encryptedFile);
     const uint32 keyFile    = fileSize(keymapFile);
-    uint32 unix             = (uint32) time(NULL);
-    uint32 speed            = 0;
-    uchar8 bufferEnc        = 0x0;
-    uchar8 bufferKey        = 0x0; 
-    uchar8 readyByte        = 0x0;
+    int status              = 0;
 
     if(encFile != keyFile)
     {
@@ -388,126 +836,127 @@ void decDef(const char *fname, const char *keyname) //default decode
         "Decryption cannot continue.\n");
         fclose(encryptedFile);
         fclose(keymapFile);
-        fclose(decryptedFile);
-        free(resultName);
-        exit(-42);
+        return -42;
     }
 
-	printf("Progress: [00.00%%], X BT/s");
-	fflush(stdout);
-    for(uint32 i = 1; i <= encFile; i++) // actual decryption happens here
+    JOURNAL jn;
+    int resumed = openJournal(&jn, opts.compress ? "decdef+z" : "decdef", 
+                              fname, encFile, fileStamp(fname));
+    if(resumed < 0)
     {
-        fread(&bufferEnc, 1, 1, encryptedFile);
-        fread(&bufferKey, 1, 1, keymapFile);
-        readyByte = bufferEnc ^ bufferKey;
-        fwrite(&readyByte, 1, 1, decryptedFile);
-        speed++;
-		if(unix < ((uint32) time(NULL)))
-        {
-			unix = progress((uint32) i, encFile, speed);
-            speed = 0;
-        }
+        fclose(encryptedFile);
+        fclose(keymapFile);
+        return resumed;
     }
-    printf("\rFile decrypted successfully.           \nDecrypted file: %s\n", 
-            resultName);
+
+    //preparing decrypted filename
+    char *resultName    = prefixName("decrypted_", fname);
+    FILE *decryptedFile = fopen(resultName, resumed ? "r+b" : "w+b");
+    free(resultName);
+    if(!decryptedFile)
+    {
+        fclose(encryptedFile);
+        fclose(keymapFile);
+        free(jn.name);
+        printf("Couldn't create decrypted file.\n");
+        return -30;
+    }
+
+    KEYSTREAM ks            = { KS_KEYMAP, keymapFile, NULL, 0, 0, NULL, 0 };
+    jn.outs[0] = decryptedFile;
+    jn.nouts = 1;
+    if(resumed)
+        status = resumeOutputs(&jn);
+    else
+        status = checkpoint(&jn, 0, 0, 1);
+    fseek(encryptedFile, jn.inOff, SEEK_SET);
+    fseek(keymapFile, jn.inOff, SEEK_SET);
+
+    if(!opts.quiet)
+        printf("Progress: [00.00%%], X BT/s");
+    fflush(stdout);
+    if(status == 0 && opts.compress) // actual decryption happens here
+        status = unpackStream(encryptedFile, decryptedFile, &ks, encFile, &jn);
+    else if(status == 0)
+        status = xorStream(encryptedFile, decryptedFile, &ks, encFile, &jn);
+    closeJournal(&jn, status == 0);
 
     fclose(encryptedFile);
     fclose(keymapFile);
     fclose(decryptedFile);
-    free(resultName);
-	
-    char usrInpt;
-	printf("Delete encrypted file (%s)? (Y/N) ", fname);
-    fflush(stdout);
-	usrInpt = getchar();
-	if(usrInpt == 'y' || usrInpt == 'Y')
-		remove(fname);
-	fflush(stdin);
-	printf("Delete keymap file (%s)? (Y/N) ", keyname);
-    fflush(stdout);
-	usrInpt = getchar();
-	if(usrInpt == 'y' || usrInpt == 'Y')
-		remove(keyname);
-    printf("All done.\n");
+    return status;
 }
 
-void decVig(const char *fname, const char *keyname) //decode using vigenere cypher
+int runDecVig(const char *fname, const char *keyname)
 {
-	FILE *efl = fopen(fname, "rb");
+	FILE *efl = openInput(fname);
     if(!efl)
     {
         printf("Error opening encrypted file (%s). Does it exist?\n", fname);
-        exit(-12);
+        return -12;
     }
     FILE *keyfl = fopen(keyname, "rb");
     if(!keyfl)
     {
         fclose(efl);
         printf("Error opening key file (%s). Does it exist?\n", keyname);
-        exit(-9);
+        return -9;
+    }
+
+    KEYSTREAM ks        = { KS_VIG, NULL, NULL, 0, 0, NULL, 0 };
+    int status          = 0;
+
+    status = loadVigKey(&ks, keyfl, keyname);
+    fclose(keyfl);
+    if(status != 0)
+    {
+        fclose(efl);
+        return status;
+    }
+    if(ks.vlen == 0)
+    {
+        printf("Your key file (%s) doesn't contain any letters.\n", keyname);
+        freeVigKey(&ks);
+        fclose(efl);
+        return -14;
     }
 
-    char *outname = calloc(strlen(fname) + strlen("decrypted_") + 1,    
-                    sizeof(char));
-    strcpy(outname, "decrypted_");
-    strcat(outname, fname);
+    if(opts.inplace && isLayout(fname))
+    {
+        printf("Error: a striped file can't be decrypted in place.\n");
+        status = -26;
+    }
+    if(opts.inplace)
+    {
+        fclose(efl);
+        if(status == 0)
+            status = vigInPlace(fname, &ks, "decvig");
+        freeVigKey(&ks);
+        return status;
+    }
 
+    char *outname = prefixName("decrypted_", fname);
     FILE *outfl = fopen(outname, "wb");
     if(!outfl)
     {
+        printf("Error creating decrypted file (%s).\n", outname);
         fclose(efl);
-        fclose(keyfl);
         free(outname);
-        printf("Error creating decrypted file (%s).\n", outname);
-        exit(-13);
+        freeVigKey(&ks);
+        return -13;
     }
+    free(outname);
 
     uint32 encsize      = fileSize(efl);
-    uint32 keySize      = fileSize(keyfl);
-    uint32 speed        = 0;
-    uint32 unix         = (uint32) time(NULL);
-    uchar8 byteFile     = 0x0;
-    uchar8 byteCipher   = 0x0;
-    uchar8 byteDec      = 0x0;
-
-    for(uint32 i = 1; i <= encsize; i++)
-    {
-        fread(&byteFile, 1, 1, efl);
-        do{
-            if(ftell(keyfl) == keySize)
-                fseek(keyfl, 0, SEEK_SET);
-            fscanf(keyfl, "%c", &byteCipher);
-        }while(isalpha(byteCipher) == 0);
-        
-        byteDec = byteFile ^ byteCipher;
-        fwrite(&byteDec, 1, 1, outfl);
-
-        speed++;
-        if(unix < (uint32) time(NULL))
-        {
-            unix = progress(i, encsize, speed);
-            speed = 0;
-        }
-    }
+    if(opts.compress)
+        status = unpackStream(efl, outfl, &ks, encsize, NULL);
+    else
+        status = xorStream(efl, outfl, &ks, encsize, NULL);
 
     fclose(efl);
-    fclose(keyfl);
     fclose(outfl);
-    free(outname);
-
-    printf("\rFile decrypted successfully.             \n");
-    printf("Delete the encrypted file (%s)? (Y/N) ", fname);
-    fflush(stdout);
-    char usrInpt = getchar();
-    if(usrInpt == 'y' || usrInpt == 'Y')
-        remove(fname);
-    printf("Would you like to delete the key file as well (%s)? (Y/N) ", keyname);
-    fflush(stdout);
-    fflush(stdin);
-    usrInpt = getchar();
-    if(usrInpt == 'y' || usrInpt == 'Y')
-        remove(keyname);
-    printf("\nAll done.\n");
+    freeVigKey(&ks);
+    return status;
 }
 
 uint32 fileSize(FILE *fl) //find out filesize of fl
@@ -521,8 +970,10 @@ uint32 fileSize(FILE *fl) //find out filesize of fl
 
 uint32 progress(uint32 current, uint32 total, uint32 speed)
 {
-	float percentage = ((float) current / (float) total) * 100.0;
-	printf("\rProgress: [%05.2f%%]", percentage);
+    if(opts.quiet)
+        return (uint32) time(NULL);
+    float percentage = ((float) current / (float) total) * 100.0;
+    printf("\rProgress: [%05.2f%%]", percentage);
     if(speed >= 1024 && speed < 1048576)
         printf(", %.2lf KB/s           ", speed/1024.0);
     else if(speed >= 1048576 && speed < 1073741824)
@@ -530,9 +981,9 @@ uint32 progress(uint32 current, uint32 total, uint32 speed)
     else if(speed >= 1073741824)
         printf(", %.2lf GB/s           ", speed/1073741824.0);
     else
-        printf(", %.2lf BT/s           ", speed);
-	fflush(stdout);
-	return (uint32) time(NULL);
+        printf(", %.2lf BT/s           ", (double) speed);
+    fflush(stdout);
+    return (uint32) time(NULL);
 }
 
 void zero(const char *filename, const uint32 filesizeX)
@@ -544,24 +995,60 @@ void zero(const char *filename, const uint32 filesizeX)
         exit(-20);
     }
 
-    uchar8 byte     = 0x0;
+    // the file itself changes as we go, so only its size is checked
+    JOURNAL jn;
+    int status = openJournal(&jn, "zero", filename, filesizeX, 0);
+    if(status < 0)
+    {
+        fclose(fl);
+        exit(status);
+    }
+    jn.outs[0] = fl;
+    jn.nouts = 1;
+    jn.keep = 1; // truncating would leave the rest of the data on disk
+    if(status == 1)
+        status = resumeOutputs(&jn);
+    else
+        status = checkpoint(&jn, 0, 0, 1);
+
+    uchar8 *zeroes  = bufGet(CHUNK_SIZE, 0);
+    uint32 done     = jn.inOff;
+    uint32 want     = 0;
     uint32 speed    = 0;
     uint32 unix     = (uint32) time(NULL);
 
+    if(zeroes)
+        memset(zeroes, 0, CHUNK_SIZE);
+    else if(status == 0)
+        status = -79;
     printf("\rProgress: [00.00%%]");
     fflush(stdout);
-    for(uint32 i = 1; i <= filesizeX; i++)
+    while(status == 0 && done < filesizeX)
     {
-        fwrite(&byte, 1, 1, fl);
-        speed++;
+        want = filesizeX - done < CHUNK_SIZE ? filesizeX - done : CHUNK_SIZE;
+        if(fwrite(zeroes, 1, want, fl) != want)
+        {
+            printf("\rError: couldn't write to %s.\n", filename);
+            status = -21;
+            break;
+        }
+        ioPace(fl, want, 1);
+        done += want;
+        speed += want;
+        status = checkpoint(&jn, done, done, 0);
         if(unix < (uint32) time(NULL))
         {
-            unix = progress(i, filesizeX, speed);
+            unix = progress(done, filesizeX, speed);
             speed = 0;
         }
     }
 
+    closeJournal(&jn, status == 0);
+    ioDone(fl);
+    bufPut(zeroes, CHUNK_SIZE, 0);
     fclose(fl);
+    if(status != 0)
+        exit(status);
     printf("\r%s has been zeroed out successfully.\n", filename);
 }
 
@@ -600,251 +1087,2966 @@ void ask(const char *fname, const uint32 filesize)
 
 void encBmp(const char *bmpname, const char *plain)
 {
-    FILE *bmp = fopen(bmpname, "rb");
-    if(!bmp)
-    {
-        printf("Couldn't open file %s. Does it exist?\n", bmpname);
-        exit(-4);
-    }
-
     FILE *text = fopen(plain, "rb");
     if(!text)
     {
-        fclose(bmp);
         printf("Couldn't open unencrypted file %s. Does it exist?\n", plain);
         exit(-17);
     }
 
-    // first, we check if we can actually work with this file
-
-    uint32 sizeText = fileSize(text);
-    BITMAPFILEHEADER fhead;
-    BITMAPINFOHEADER ihead;
-    fread(&fhead, sizeof(BITMAPFILEHEADER), 1, bmp);
-    fread(&ihead, sizeof(BITMAPINFOHEADER), 1, bmp);
+    BMPSTREAM bs;
+    uint32 tsize    = fileSize(text);
+    char *outname   = prefixName("encrypted_", bmpname);
 
-    if(fhead.bfType != 0x4d42)
+    // the carrier is checked before the output is created, so one that's
+    // too small neither leaves half an image behind nor wipes out an
+    // encrypted image from an earlier run
+    int status      = openBmp(&bs, bmpname, NULL);
+    if(status == 0)
+    {
+        if(tsize > bs.capacity)
+        {
+            printf("This bitmap image is too small to encode your data in it.\n");
+            status = -44;
+        }
+        bmpClose(&bs, 0);
+    }
+    if(status == 0)
+        status = openBmp(&bs, bmpname, outname);
+    if(status != 0)
     {
-        printf("The file provided doesn't seem to be a proper bitmap file.\n");
-        fclose(bmp);
         fclose(text);
-        exit(-27);
+        free(outname);
+        exit(status);
+    }
+
+    uchar8 *chunk   = bufGet(CHUNK_SIZE, 0);
+    uint32 done     = 0;
+    uint32 want     = 0;
+
+    if(!chunk)
+        status = -79;
+    while(status == 0 && done < tsize)
+    {
+        want = tsize - done < CHUNK_SIZE ? tsize - done : CHUNK_SIZE;
+        if(fread(chunk, 1, want, text) != want)
+        {
+            printf("Error: couldn't read %s.\n", plain);
+            status = -17;
+        }
+        else if((status = bmpPut(&bs, chunk, want)) == 0)
+            done += want;
+    }
+    bufPut(chunk, CHUNK_SIZE, 0);
+    fclose(text);
+
+    int closed = bmpClose(&bs, status == 0);
+    if(status == 0)
+        status = closed;
+    if(status != 0)
+    {
+        remove(outname);
+        free(outname);
+        exit(status);
+    }
+
+    printf("%lu bytes have been altered and written to %s.\n", tsize, outname);
+    free(outname);
+}
+
+void decBmp(const char *fname, const uint32 amount)
+{
+    BMPSTREAM bs;
+    int status = openBmp(&bs, fname, NULL);
+    if(status != 0)
+        exit(status);
+
+    if(amount > bs.capacity)
+    {
+        printf("The number of bytes to extract is too large.\n");
+        bmpClose(&bs, 0);
+        exit(-355);
+    }
+
+    char *outname = prefixName("decrypted_", fname);
+    FILE *output = fopen(outname, "wb");
+    if(!output)
+    {
+        printf("Unable to create file for output.\n");
+        bmpClose(&bs, 0);
+        free(outname);
+        exit(-211);
+    }
+
+    uchar8 *chunk   = bufGet(CHUNK_SIZE, 0);
+    uint32 done     = 0;
+    uint32 want     = 0;
+
+    if(!chunk)
+        status = -79;
+    while(status == 0 && done < amount)
+    {
+        want = amount - done < CHUNK_SIZE ? amount - done : CHUNK_SIZE;
+        if((status = bmpGet(&bs, chunk, want)) != 0)
+            break;
+        if(fwrite(chunk, 1, want, output) != want)
+        {
+            printf("Error: couldn't write to %s.\n", outname);
+            status = -211;
+        }
+        done += want;
+    }
+    bufPut(chunk, CHUNK_SIZE, 0);
+    bmpClose(&bs, 0);
+    if(fclose(output) != 0 && status == 0)
+        status = -211;
+    if(status != 0)
+    {
+        remove(outname);
+        free(outname);
+        exit(status);
+    }
+
+    printf("%lu bytes have been extracted into the file %s.\n", amount, outname);
+    free(outname);
+}
+
+// --bmpinfo: reads the headers only and says how much the image can hold
+void bmpInfo(const char *fname)
+{
+    FILE *bmp = fopen(fname, "rb");
+    if(!bmp)
+    {
+        printf("Couldn't open file %s. Does it exist?\n", fname);
+        exit(-4);
+    }
+
+    BMPSTREAM bs;
+    memset(&bs, 0, sizeof(bs));
+    int status = bmpLayout(bmp, fname, &bs);
+    fclose(bmp);
+    if(status != 0)
+        exit(status);
+
+    const char *header  = bs.infosize == 40 ? "BITMAPINFOHEADER"
+                        : bs.infosize == 108 ? "BITMAPV4HEADER"
+                        : bs.infosize == 124 ? "BITMAPV5HEADER" : "unknown header";
+    uint32 usable       = bs.width * 3 * bs.rows; // colour bytes, alpha left out
+
+    printf("%s: %lu x %lu, %lu-bit, %s\n", fname, bs.width, bs.rows,
+           bs.pixel * 8, bs.topdown ? "top-down" : "bottom-up");
+    printf("Header: %s (%lu bytes), pixels start at byte %lu\n",
+           header, bs.infosize, bs.offset);
+    printf("Row: %lu pixel bytes + %lu padding%s\n", bs.rowbytes, bs.padding,
+           bs.alpha >= 0 ? ", alpha/unused bytes are skipped" : "");
+    printf("Usable colour bytes: %lu\n", usable);
+    for(int depth = 1; depth <= 4; depth++)
+        printf("  %d low bit%s per byte: %lu bytes%s\n", depth, depth > 1 ? "s" : "",
+               (uint32) ((unsigned long long) usable * depth / 8),
+               depth == 2 ? " (--encbmp, --decbmp, --chain)" : "");
+}
+
+// reads and checks the headers of an opened bitmap and fills in the row
+// layout of bs. handles 24-bit BGR and 32-bit BGRA/BGRX images (BI_RGB,
+// or BI_BITFIELDS with whole byte masks), any header version, gaps or
+// colour tables before bfOffBits and bottom-up or top-down rows.
+int bmpLayout(FILE *bmp, const char *fname, BMPSTREAM *bs)
+{
+    BITMAPFILEHEADER fhead;
+    BITMAPINFOHEADER ihead;
+    DWORD masks[3];
+    uint32 fsize = fileSize(bmp);
+    int used = 0, found = 0;
+
+    if(fread(&fhead, sizeof(fhead), 1, bmp) != 1
+        || fread(&ihead, sizeof(ihead), 1, bmp) != 1
+        || fhead.bfType != 0x4d42 || ihead.biSize < sizeof(ihead)
+        || ihead.biWidth <= 0 || ihead.biHeight == 0 || ihead.biHeight == INT32_MIN)
+    {
+        printf("%s doesn't seem to be a proper bitmap file.\n", fname);
+        return -27;
+    }
+    if(ihead.biBitCount != 24 && ihead.biBitCount != 32)
+    {
+        printf("%s is not a 24-bit or 32-bit bitmap image.\n", fname);
+        return -26;
+    }
+
+    bs->alpha = ihead.biBitCount == 32 ? 3 : -1; // plain BGRA, alpha last
+    if(ihead.biBitCount == 32 && (ihead.biCompression == 3 || ihead.biCompression == 6))
+    {
+        // BI_BITFIELDS/BI_ALPHABITFIELDS: the masks come right after the
+        // 40 byte header, also when they're part of a V4/V5 one. each of
+        // them has to be one whole byte, the byte left over is alpha.
+        if(fread(masks, sizeof(DWORD), 3, bmp) != 3)
+        {
+            printf("%s doesn't seem to be a proper bitmap file.\n", fname);
+            return -27;
+        }
+        for(int i = 0; i < 3; i++)
+            for(int b = 0; b < 4; b++)
+                if(masks[i] == (DWORD) 0xff << (8 * b) && !(used & 1 << b))
+                {
+                    used |= 1 << b;
+                    found++;
+                }
+        bs->alpha = -2;
+        for(int b = 0; found == 3 && b < 4; b++)
+            if(!(used & 1 << b))
+                bs->alpha = b;
+    }
+    else if(ihead.biCompression != 0)
+        bs->alpha = -2;
+    if(bs->alpha == -2)
+    {
+        printf("%s is not an uncompressed bitmap file.\n", fname);
+        return -56;
+    }
+
+    bs->infosize    = ihead.biSize;
+    bs->width       = (uint32) ihead.biWidth;
+    bs->pixel       = ihead.biBitCount / 8;
+    bs->topdown     = ihead.biHeight < 0;
+    bs->rows        = bs->topdown ? -ihead.biHeight : ihead.biHeight;
+    bs->offset      = fhead.bfOffBits;
+    bs->rowbytes    = bs->width * bs->pixel;
+    bs->padding     = (4 - bs->rowbytes % 4) % 4; // pure magic
+    bs->capacity    = (uint32) ((unsigned long long) bs->width * 3 * bs->rows / 4);
+
+    if(bs->offset < sizeof(fhead) + bs->infosize
+        || (unsigned long long) bs->offset
+           + (unsigned long long) (bs->rowbytes + bs->padding) * bs->rows > fsize)
+    {
+        printf("%s is shorter than its headers say.\n", fname);
+        return -27;
+    }
+    return 0;
+}
+
+// bitmap streams for --encbmp, --decbmp and --chain: two bits of data go
+// into the low bits of every colour byte, most significant pair first.
+// rows are taken in file order whichever way up the image is, and whole
+// rows are loaded and written back, so padding and alpha bytes are
+// copied but never used.
+int openBmp(BMPSTREAM *bs, const char *fname, const char *outname)
+{
+    int status = 0;
+    uint32 left, want;
+
+    memset(bs, 0, sizeof(*bs));
+    bs->bmp = fopen(fname, "rb");
+    if(!bs->bmp)
+    {
+        printf("Couldn't open file %s. Does it exist?\n", fname);
+        return -4;
+    }
+
+    status = bmpLayout(bs->bmp, fname, bs);
+    if(status == 0 && outname && !(bs->out = fopen(outname, "wb")))
+    {
+        printf("Unable to create encrypted bitmap.\n");
+        status = -61;
+    }
+    if(status == 0 && !(bs->row = bufGet(bs->rowbytes + bs->padding, 0)))
+        status = -79;
+
+    // headers, masks, colour table and whatever else sits before the
+    // pixels go over as they are
+    fseek(bs->bmp, 0, SEEK_SET);
+    for(left = bs->offset; status == 0 && bs->out && left > 0; left -= want)
+    {
+        want = left < bs->rowbytes + bs->padding ? left : bs->rowbytes + bs->padding;
+        if(fread(bs->row, 1, want, bs->bmp) != want
+            || fwrite(bs->row, 1, want, bs->out) != want)
+        {
+            printf("Error: couldn't write the bitmap image.\n");
+            status = -90;
+        }
+    }
+    if(status != 0)
+    {
+        if(bs->out)
+        {
+            fclose(bs->out);
+            remove(outname);
+        }
+        fclose(bs->bmp);
+        bufPut(bs->row, bs->rowbytes + bs->padding, 0);
+        return status;
+    }
+
+    fseek(bs->bmp, bs->offset, SEEK_SET);
+    bs->rowpos = bs->rowbytes; // nothing loaded yet
+    return 0;
+}
+
+static int bmpNextRow(BMPSTREAM *bs)
+{
+    uint32 len = bs->rowbytes + bs->padding;
+
+    if(bs->out && bs->loaded && fwrite(bs->row, 1, len, bs->out) != len)
+    {
+        printf("\rError: couldn't write the bitmap image.\n");
+        return -90;
+    }
+    if(bs->rows == 0 || fread(bs->row, 1, len, bs->bmp) != len)
+    {
+        printf("\rError: the bitmap image ended too early.\n");
+        return -93;
+    }
+    bs->rows--;
+    bs->rowpos = bs->alpha == 0 ? 1 : 0;
+    bs->loaded = 1;
+    return 0;
+}
+
+static void bmpStep(BMPSTREAM *bs) // past the byte just used and any alpha after it
+{
+    bs->rowpos++;
+    if(bs->alpha >= 0 && (int) (bs->rowpos % 4) == bs->alpha)
+        bs->rowpos++;
+}
+
+int bmpPut(BMPSTREAM *bs, const uchar8 *data, uint32 len)
+{
+    int status, shift;
+
+    for(uint32 i = 0; i < len; i++)
+    {
+        if(bs->count == bs->capacity)
+        {
+            printf("\rThis bitmap image is too small to encode your data in it.\n");
+            return -44;
+        }
+        for(shift = 6; shift >= 0; shift -= 2)
+        {
+            if(bs->rowpos >= bs->rowbytes && (status = bmpNextRow(bs)) != 0)
+                return status;
+            bs->row[bs->rowpos] = (bs->row[bs->rowpos] & 0xfc)
+                                | ((data[i] >> shift) & 3);
+            bmpStep(bs);
+        }
+        bs->count++;
+    }
+    return 0;
+}
+
+int bmpGet(BMPSTREAM *bs, uchar8 *data, uint32 len)
+{
+    int status, shift;
+
+    if(len > bs->capacity - bs->count)
+    {
+        printf("\rThe number of bytes to extract is too large.\n");
+        return -355;
+    }
+    for(uint32 i = 0; i < len; i++)
+    {
+        data[i] = 0;
+        for(shift = 6; shift >= 0; shift -= 2)
+        {
+            if(bs->rowpos >= bs->rowbytes && (status = bmpNextRow(bs)) != 0)
+                return status;
+            data[i] |= (bs->row[bs->rowpos] & 3) << shift;
+            bmpStep(bs);
+        }
+        bs->count++;
+    }
+    return 0;
+}
+
+// an embedding that went fine gets the rest of the carrier copied over
+int bmpClose(BMPSTREAM *bs, int finished)
+{
+    uint32 len = bs->rowbytes + bs->padding;
+    size_t got;
+    int status = 0;
+
+    if(bs->out && finished)
+    {
+        if(bs->loaded && fwrite(bs->row, 1, len, bs->out) != len)
+            status = -90;
+        while(status == 0 && (got = fread(bs->row, 1, len, bs->bmp)) > 0)
+            if(fwrite(bs->row, 1, got, bs->out) != got)
+                status = -90;
+        if(status != 0)
+            printf("\rError: couldn't write the bitmap image.\n");
+    }
+    if(bs->out && fclose(bs->out) != 0 && status == 0)
+        status = -96;
+    fclose(bs->bmp);
+    bufPut(bs->row, bs->rowbytes + bs->padding, 0);
+    bs->row = NULL;
+    return status;
+}
+
+void parseOpts(int *argc, char *argv[]) // pulls option flags out of argv
+{
+    int n = *argc < 2 ? *argc : 2;
+    for(int i = 2; i < *argc; i++)
+    {
+        if(strcmp(argv[i], "--compress") == 0)
+            opts.compress = 1;
+        else if(strcmp(argv[i], "--resume") == 0)
+            opts.resume = 1;
+        else if(strcmp(argv[i], "--in-place") == 0)
+            opts.inplace = 1;
+        else if(strcmp(argv[i], "--workers") == 0 && i + 1 < *argc)
+            opts.workers = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--keymap-dir") == 0 && i + 1 < *argc)
+            opts.keymapDir = argv[++i];
+        else if(strcmp(argv[i], "--stripe-enc") == 0 && i + 1 < *argc)
+            opts.stripeEnc = argv[++i];
+        else if(strcmp(argv[i], "--stripe-key") == 0 && i + 1 < *argc)
+            opts.stripeKey = argv[++i];
+        else if(strcmp(argv[i], "--max-rate") == 0 && i + 1 < *argc)
+            opts.maxRate = parseSize(argv[++i]);
+        else if(strcmp(argv[i], "--max-iops") == 0 && i + 1 < *argc)
+            opts.maxIops = parseSize(argv[++i]);
+        else if(strcmp(argv[i], "--no-cache") == 0)
+            opts.nocache = 1;
+        else if(strcmp(argv[i], "--direct") == 0)
+            opts.direct = 1;
+        else if(strcmp(argv[i], "--idle") == 0)
+            opts.idle = 1;
+        else if(strcmp(argv[i], "--max-memory") == 0 && i + 1 < *argc)
+            opts.maxMemory = parseSize(argv[++i]);
+        else if(strcmp(argv[i], "--lock-keys") == 0)
+            opts.lockKeys = 1;
+        else
+            argv[n++] = argv[i];
+    }
+    *argc = n;
+}
+
+int checkOpts(const char *mode)
+{
+    if(opts.inplace && strcmp(mode, "--encvig") != 0 
+        && strcmp(mode, "--decvig") != 0)
+    {
+        printf("Error: --in-place only works with --encvig and --decvig.\n");
+        return -23;
+    }
+    if(opts.inplace && opts.compress)
+    {
+        printf("Error: --compress changes the size, it can't be done in place.\n");
+        return -24;
+    }
+    if(opts.keymapDir && strcmp(mode, "--encdef") != 0 
+        && strcmp(mode, "--chain") != 0)
+    {
+        printf("Error: --keymap-dir only works with --encdef and --chain.\n");
+        return -25;
+    }
+    if(opts.stripeKey && strcmp(mode, "--encdef") != 0)
+    {
+        printf("Error: --stripe-key only works with --encdef.\n");
+        return -25;
+    }
+    if((opts.compress || opts.resume) && strcmp(mode, "--chain") == 0)
+    {
+        printf("Error: a chain has its own compress stage and can't be resumed.\n");
+        return -24;
+    }
+    if(opts.stripeEnc && strcmp(mode, "--encdef") != 0 
+        && strcmp(mode, "--encvig") != 0)
+    {
+        printf("Error: --stripe-enc only works with --encdef and --encvig.\n");
+        return -25;
+    }
+    if((opts.stripeEnc || opts.stripeKey) && (opts.resume || opts.inplace))
+    {
+        printf("Error: striped outputs can't be resumed or done in place.\n");
+        return -26;
+    }
+#ifdef _WIN32
+    if(opts.maxRate || opts.maxIops || opts.nocache || opts.direct || opts.idle)
+    {
+        printf("Error: I/O throttling and cache options don't work on Windows.\n");
+        return -89;
+    }
+#endif
+    return 0;
+}
+
+char *prefixName(const char *prefix, const char *path)
+{
+    const char *base = strrchr(path, '/');
+#ifdef _WIN32
+    if(strrchr(path, '\\') > base)
+        base = strrchr(path, '\\');
+#endif
+    size_t dirlen = base ? (size_t) (base + 1 - path) : 0;
+    char *name = (char *) calloc(strlen(path) + strlen(prefix) + 1, 
+                sizeof(char));
+    memcpy(name, path, dirlen);
+    strcat(name, prefix);
+    strcat(name, path + dirlen);
+    return name;
+}
+
+uint32 pathSize(const char *fname)
+{
+    struct stat st;
+    if(stat(fname, &st) != 0)
+        return 0;
+    return (uint32) st.st_size;
+}
+
+int loadVigKey(KEYSTREAM *ks, FILE *keyfl, const char *keyname)
+{
+    uint32 size = fileSize(keyfl);
+    uchar8 *key = bufGet(size + 1, 1);
+    uint32 n    = 0;
+    long long stamp[KEY_STAMP];
+    int stamped = keyStamp(keyfl, stamp) == 0; // before the letters are read
+    int c;
+
+    if(!key)
+        return -79;
+    ks->vkey = key;
+    ks->vsize = size + 1;
+    if(stamped && cachedVigKey(keyname, stamp, key, &ks->vlen)) // daemon only
+        return 0;
+
+    // only letters count as key bytes, everything else is skipped
+    while((c = fgetc(keyfl)) != EOF)
+        if(isalpha(c))
+            key[n++] = (uchar8) c;
+    ks->vlen = n;
+    if(stamped)
+        storeVigKey(keyname, stamp, key, n);
+    return 0;
+}
+
+void freeVigKey(KEYSTREAM *ks)
+{
+    bufPut(ks->vkey, ks->vsize, 1);
+    ks->vkey = NULL;
+}
+
+int keyXor(KEYSTREAM *ks, uchar8 *buf, uint32 len)
+{
+    uint32 i;
+    switch(ks->kind)
+    {
+        case KS_RANDOM:
+            randombytes_buf(ks->scratch, len);
+            if(fwrite(ks->scratch, 1, len, ks->keymap) != len)
+            {
+                printf("\rError: couldn't write to the keymap file.\n");
+                return -91;
+            }
+            ioPace(ks->keymap, len, 1);
+            break;
+        case KS_KEYMAP:
+            if(fread(ks->scratch, 1, len, ks->keymap) != len)
+            {
+                printf("\rError: the keymap file ended too early.\n");
+                return -92;
+            }
+            ioPace(ks->keymap, len, 0);
+            break;
+        case KS_VIG:
+            for(i = 0; i < len; i++)
+            {
+                ks->scratch[i] = ks->vkey[ks->vpos++];
+                if(ks->vpos == ks->vlen)
+                    ks->vpos = 0;
+            }
+            break;
+        case KS_NONE: // the engine only moves (and packs) the data
+            return 0;
+    }
+
+    for(i = 0; i < len; i++)
+        buf[i] ^= ks->scratch[i];
+    return 0;
+}
+
+int xorStream(FILE *in, FILE *out, KEYSTREAM *ks, uint32 total, JOURNAL *jn)
+{
+    // one block for everything, so jobs never hold half of what they need
+    uchar8 *buffer  = bufGet(XOR_BLOCK, 1);
+    uchar8 *scratch = buffer + CHUNK_SIZE;
+    uint32 done     = jn ? jn->inOff : 0; // both files move in lockstep
+    uint32 speed    = 0;
+    uint32 unix     = (uint32) time(NULL);
+    uint32 want     = 0;
+    int status      = buffer ? 0 : -79;
+
+    ks->scratch = scratch;
+    while(status == 0 && done < total)
+    {
+        want = total - done < CHUNK_SIZE ? total - done : CHUNK_SIZE;
+        if(fread(buffer, 1, want, in) != want)
+        {
+            printf("\rError: couldn't read the input file.\n");
+            status = -93;
+            break;
+        }
+        ioPace(in, want, 0);
+        if((status = keyXor(ks, buffer, want)) != 0)
+            break;
+        if(fwrite(buffer, 1, want, out) != want)
+        {
+            printf("\rError: couldn't write the output file.\n");
+            status = -90;
+            break;
+        }
+        ioPace(out, want, 1);
+
+        done += want;
+        speed += want;
+        if(jn && (status = checkpoint(jn, done, done, 0)) != 0)
+            break;
+        if(unix < (uint32) time(NULL))
+        {
+            unix = progress(done, total, speed);
+            speed = 0;
+        }
+    }
+
+    ioDone(in);
+    ioDone(out);
+    ioDone(ks->keymap);
+    bufPut(buffer, XOR_BLOCK, 1);
+    ks->scratch = NULL;
+    return status;
+}
+
+// --compress framing (all of it goes through the keystream):
+//   "AVPZ" + chunk size, then per chunk: stored size (RAW_CHUNK set if
+//   the chunk is kept as is), raw size, payload. a 0/0 chunk ends it.
+int packStream(FILE *in, FILE *out, KEYSTREAM *ks, uint32 total, JOURNAL *jn)
+{
+    uchar8 *buffer  = bufGet(PACK_BLOCK, 1);
+    uchar8 *frame   = buffer + CHUNK_SIZE;
+    uchar8 *scratch = frame + CHUNK_SIZE + FRAME_HEAD;
+    uint32 done     = jn ? jn->inOff : 0;
+    uint32 packed   = jn ? jn->outOff : 0;
+    uint32 speed    = 0;
+    uint32 unix     = (uint32) time(NULL);
+    uint32 want     = 0;
+    uint32 stored   = 0;
+    int status      = buffer ? 0 : -79;
+
+    ks->scratch = scratch;
+    if(status == 0 && packed == 0) // a resumed run has written the header already
+    {
+        memcpy(frame, "AVPZ", 4);
+        put32(frame + 4, CHUNK_SIZE);
+        status = putFrame(out, ks, frame, FRAME_HEAD);
+        packed = FRAME_HEAD;
+    }
+
+    while(status == 0 && done < total)
+    {
+        want = total - done < CHUNK_SIZE ? total - done : CHUNK_SIZE;
+        if(fread(buffer, 1, want, in) != want)
+        {
+            printf("\rError: couldn't read the input file.\n");
+            status = -93;
+            break;
+        }
+        ioPace(in, want, 0);
+
+        // must come out strictly smaller, otherwise the chunk is kept raw
+        stored = lz4Compress(buffer, want, frame + FRAME_HEAD, want - 1);
+        if(stored == 0)
+        {
+            memcpy(frame + FRAME_HEAD, buffer, want);
+            put32(frame, want | RAW_CHUNK);
+            stored = want;
+        }
+        else
+            put32(frame, stored);
+        put32(frame + 4, want);
+        status = putFrame(out, ks, frame, FRAME_HEAD + stored);
+
+        done += want;
+        packed += FRAME_HEAD + stored;
+        speed += want;
+        if(status == 0 && jn)
+            status = checkpoint(jn, done, packed, 0);
+        if(unix < (uint32) time(NULL))
+        {
+            unix = progress(done, total, speed);
+            speed = 0;
+        }
+    }
+
+    if(status == 0)
+    {
+        put32(frame, 0);
+        put32(frame + 4, 0);
+        status = putFrame(out, ks, frame, FRAME_HEAD);
+        packed += FRAME_HEAD;
+        if(!opts.quiet)
+            printf("\rCompressed %lu bytes down to %lu.          \n", 
+                    total, packed);
+    }
+
+    ioDone(in);
+    ioDone(out);
+    ioDone(ks->keymap);
+    bufPut(buffer, PACK_BLOCK, 1);
+    ks->scratch = NULL;
+    return status;
+}
+
+int unpackStream(FILE *in, FILE *out, KEYSTREAM *ks, uint32 total, JOURNAL *jn)
+{
+    uchar8 *buffer  = bufGet(PACK_BLOCK, 1);
+    uchar8 *frame   = buffer + CHUNK_SIZE;
+    uchar8 *scratch = frame + CHUNK_SIZE + FRAME_HEAD;
+    uint32 done     = jn ? jn->inOff : 0;
+    uint32 written  = jn ? jn->outOff : 0;
+    uint32 speed    = 0;
+    uint32 unix     = (uint32) time(NULL);
+    uint32 stored   = 0;
+    uint32 raw      = 0;
+    int status      = buffer ? 0 : -79;
+
+    ks->scratch = scratch;
+    if(status == 0 && done == 0)
+    {
+        status = getFrame(in, ks, frame, FRAME_HEAD);
+        if(status == 0 && (memcmp(frame, "AVPZ", 4) != 0 
+            || get32(frame + 4) > CHUNK_SIZE))
+        {
+            printf("\rError: this file wasn't encrypted with --compress.\n");
+            status = -94;
+        }
+        done = FRAME_HEAD;
+    }
+
+    while(status == 0)
+    {
+        if((status = getFrame(in, ks, frame, FRAME_HEAD)) != 0)
+            break;
+        stored = get32(frame) & ~RAW_CHUNK;
+        raw = get32(frame + 4);
+        if(stored == 0 && raw == 0) // end of stream, nothing may follow it
+        {
+            if(getc(in) != EOF)
+            {
+                printf("\rError: the compressed data is corrupted.\n");
+                status = -95;
+            }
+            break;
+        }
+
+        if(stored > CHUNK_SIZE || raw > CHUNK_SIZE 
+            || ((get32(frame) & RAW_CHUNK) && stored != raw))
+        {
+            printf("\rError: the compressed data is corrupted.\n");
+            status = -95;
+            break;
+        }
+        if((status = getFrame(in, ks, frame + FRAME_HEAD, stored)) != 0)
+            break;
+
+        if(get32(frame) & RAW_CHUNK)
+            memcpy(buffer, frame + FRAME_HEAD, raw);
+        else if(lz4Decompress(frame + FRAME_HEAD, stored, buffer, CHUNK_SIZE) 
+                != (int) raw)
+        {
+            printf("\rError: the compressed data is corrupted.\n");
+            status = -95;
+            break;
+        }
+        if(fwrite(buffer, 1, raw, out) != raw)
+        {
+            printf("\rError: couldn't write the output file.\n");
+            status = -90;
+            break;
+        }
+        ioPace(out, raw, 1);
+
+        done += FRAME_HEAD + stored;
+        written += raw;
+        speed += FRAME_HEAD + stored;
+        if(jn && (status = checkpoint(jn, done, written, 0)) != 0)
+            break;
+        if(unix < (uint32) time(NULL))
+        {
+            unix = progress(done, total, speed);
+            speed = 0;
+        }
+    }
+
+    ioDone(in);
+    ioDone(out);
+    ioDone(ks->keymap);
+    bufPut(buffer, PACK_BLOCK, 1);
+    ks->scratch = NULL;
+    return status;
+}
+
+int putFrame(FILE *out, KEYSTREAM *ks, uchar8 *frame, uint32 len)
+{
+    int status = keyXor(ks, frame, len);
+    if(status == 0 && fwrite(frame, 1, len, out) != len)
+    {
+        printf("\rError: couldn't write the output file.\n");
+        status = -90;
+    }
+    if(status == 0)
+        ioPace(out, len, 1);
+    return status;
+}
+
+int getFrame(FILE *in, KEYSTREAM *ks, uchar8 *frame, uint32 len)
+{
+    if(fread(frame, 1, len, in) != len)
+    {
+        printf("\rError: the encrypted file ended too early.\n");
+        return -93;
+    }
+    ioPace(in, len, 0);
+    return keyXor(ks, frame, len);
+}
+
+void put32(uchar8 *p, uint32 v) // little endian, whatever the host is
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+uint32 get32(const uchar8 *p)
+{
+    return (uint32) p[0] | ((uint32) p[1] << 8) 
+        | ((uint32) p[2] << 16) | ((uint32) p[3] << 24);
+}
+
+// a tiny LZ4 block codec (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md)
+// greedy matching over a 4K-entry hash table; random-looking data makes
+// it skip ahead faster and faster so incompressible chunks stay cheap.
+int lz4Compress(const uchar8 *src, int srclen, uchar8 *dst, int cap)
+{
+    int table[1 << LZ_HASHLOG];
+    int ip      = 0;
+    int op      = 0;
+    int anchor  = 0;
+    int misses  = 0;
+    int ref, mlen;
+    DWORD seq, cand;
+
+    memset(table, 0, sizeof(table));
+    while(ip < srclen - 12) // last 12 bytes are always literals
+    {
+        memcpy(&seq, src + ip, 4);
+        int h = (DWORD) (seq * 2654435761U) >> (32 - LZ_HASHLOG);
+        ref = table[h];
+        table[h] = ip;
+        memcpy(&cand, src + ref, 4);
+
+        if(ref < ip && ip - ref < 65536 && cand == seq)
+        {
+            mlen = 4;
+            while(ip + mlen < srclen - 5 && src[ref + mlen] == src[ip + mlen])
+                mlen++;
+            if(lz4Sequence(dst, &op, cap, src + anchor, ip - anchor, 
+                ip - ref, mlen) != 0)
+                return 0;
+            ip += mlen;
+            anchor = ip;
+            misses = 0;
+        }
+        else
+            ip += 1 + (misses++ >> 6);
+    }
+
+    if(lz4Sequence(dst, &op, cap, src + anchor, srclen - anchor, 0, 0) != 0)
+        return 0;
+    return op;
+}
+
+int lz4Sequence(uchar8 *dst, int *op, int cap, const uchar8 *lit, int litlen,
+                int offset, int mlen)
+{
+    int o = *op;
+    int n;
+
+    if(o + litlen + litlen / 255 + mlen / 255 + 6 > cap)
+        return -1; // doesn't fit
+
+    uchar8 *token = dst + o++;
+    if(litlen >= 15)
+    {
+        *token = 15 << 4;
+        for(n = litlen - 15; n >= 255; n -= 255)
+            dst[o++] = 255;
+        dst[o++] = n;
+    }
+    else
+        *token = litlen << 4;
+    memcpy(dst + o, lit, litlen);
+    o += litlen;
+
+    if(mlen != 0) // the last sequence has literals only
+    {
+        dst[o++] = offset & 0xff;
+        dst[o++] = offset >> 8;
+        if(mlen - 4 >= 15)
+        {
+            *token |= 15;
+            for(n = mlen - 4 - 15; n >= 255; n -= 255)
+                dst[o++] = 255;
+            dst[o++] = n;
+        }
+        else
+            *token |= mlen - 4;
+    }
+
+    *op = o;
+    return 0;
+}
+
+int lz4Decompress(const uchar8 *src, int srclen, uchar8 *dst, int cap)
+{
+    int ip = 0;
+    int op = 0;
+    int len, offset;
+    uchar8 token, b;
+
+    while(ip < srclen)
+    {
+        token = src[ip++];
+        len = token >> 4;
+        if(len == 15)
+            do
+            {
+                if(ip >= srclen)
+                    return -1;
+                b = src[ip++];
+                len += b;
+            }while(b == 255);
+        if(len > srclen - ip || len > cap - op)
+            return -1;
+        memcpy(dst + op, src + ip, len);
+        ip += len;
+        op += len;
+        if(ip == srclen)
+            break;
+
+        if(ip + 2 > srclen)
+            return -1;
+        offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > op)
+            return -1;
+
+        len = token & 15;
+        if(len == 15)
+            do
+            {
+                if(ip >= srclen)
+                    return -1;
+                b = src[ip++];
+                len += b;
+            }while(b == 255);
+        len += 4;
+        if(len > cap - op)
+            return -1;
+        for(; len > 0; len--, op++) // may overlap, so byte by byte
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
+
+// checkpoints: every CKPT_EVERY bytes the outputs are flushed and synced,
+// then journal_<input> is replaced (write, sync, rename) with the new
+// committed offsets. it goes away once the job is done, so a leftover
+// journal means the outputs next to it are incomplete.
+int openJournal(JOURNAL *jn, const char *mode, const char *input, 
+                uint32 insize, long long stamp)
+{
+    char jmode[16];
+    unsigned long jsize, jin, jout;
+    long long jstamp;
+    int jnouts;
+
+    memset(jn, 0, sizeof(JOURNAL));
+    jn->name = prefixName("journal_", input);
+    jn->mode = mode;
+    jn->insize = insize;
+    jn->stamp = stamp;
+
+    FILE *fl = fopen(jn->name, "r");
+    if(!fl)
+        return 0; // nothing to resume, fresh start
+
+    if(!opts.resume)
+    {
+        printf("Found an unfinished job (%s). Run again with --resume, ", 
+                jn->name);
+        printf("or delete it to start over.\n");
+        fclose(fl);
+        free(jn->name);
+        return -80;
+    }
+
+    if(fscanf(fl, "AVPES journal %15s %lu %lld %lu %lu %d %llx %llx", 
+        jmode, &jsize, &jstamp, &jin, &jout, &jnouts, 
+        &jn->tail[0], &jn->tail[1]) != 8)
+        jmode[0] = '\0';
+    else if(strcmp(jmode, mode) != 0 
+        && strncmp(jmode, mode, strcspn(mode, "+")) == 0 
+        && strncmp(jmode, mode, strcspn(jmode, "+")) == 0)
+    {
+        // "+z" = the output is in --compress frames, the rest has to match
+        printf("%s was started %s --compress, resume it the same way.\n", 
+                jn->name, strchr(jmode, '+') ? "with" : "without");
+        fclose(fl);
+        free(jn->name);
+        return -81;
+    }
+    if(strcmp(jmode, mode) != 0 || jsize != insize || jstamp != stamp)
+    {
+        printf("%s doesn't belong to this job (or the input has changed).\n", 
+                jn->name);
+        fclose(fl);
+        free(jn->name);
+        return -81;
+    }
+    fclose(fl);
+
+    jn->inOff = jin;
+    jn->outOff = jout;
+    printf("Resuming from %.2f%%.\n", insize ? 100.0 * jin / insize : 100.0);
+    return 1;
+}
+
+int resumeOutputs(JOURNAL *jn)
+{
+    for(int i = 0; i < jn->nouts; i++)
+    {
+        if(fileSize(jn->outs[i]) < jn->outOff 
+            || tailHash(jn->outs[i], jn->outOff) != jn->tail[i])
+        {
+            printf("The partial output doesn't match %s, can't resume.\n", 
+                    jn->name);
+            return -82;
+        }
+        // anything past the checkpoint may be half-written, drop it
+        if(!jn->keep && truncFile(jn->outs[i], jn->outOff) != 0)
+        {
+            printf("Couldn't cut the partial output back to the checkpoint.\n");
+            return -83;
+        }
+        fseek(jn->outs[i], jn->outOff, SEEK_SET);
+    }
+    return 0;
+}
+
+int checkpoint(JOURNAL *jn, uint32 inOff, uint32 outOff, int force)
+{
+    if(!force && inOff - jn->inOff < CKPT_EVERY)
+        return 0;
+
+    for(int i = 0; i < jn->nouts; i++)
+    {
+        if(syncFile(jn->outs[i]) != 0)
+        {
+            printf("\rError: couldn't flush the output to disk.\n");
+            return -84;
+        }
+        jn->tail[i] = tailHash(jn->outs[i], outOff);
+    }
+
+    char *tmpname;
+    FILE *fl = replaceBegin(jn->name, &tmpname);
+    if(fl)
+        fprintf(fl, "AVPES journal %s %lu %lld %lu %lu %d %llx %llx\n", jn->mode, 
+                jn->insize, jn->stamp, inOff, outOff, jn->nouts, 
+                jn->tail[0], jn->tail[1]);
+    if(replaceEnd(fl, tmpname, jn->name) != 0)
+    {
+        printf("\rError: couldn't write the journal (%s).\n", jn->name);
+        return -85;
+    }
+
+    jn->inOff = inOff;
+    jn->outOff = outOff;
+    return 0;
+}
+
+void closeJournal(JOURNAL *jn, int finished)
+{
+    int durable = 1;
+    if(finished) // outputs must be on disk before the marker goes
+    {
+        for(int i = 0; i < jn->nouts; i++)
+            if(syncFile(jn->outs[i]) != 0)
+                durable = 0;
+        if(durable && remove(jn->name) == 0)
+            syncDir(jn->name); // or the job could look unfinished again
+    }
+    free(jn->name);
+    jn->name = NULL;
+}
+
+unsigned long long tailHash(FILE *fl, uint32 end)
+{
+    uchar8 buffer[CKPT_TAIL];
+    uint32 start = end > CKPT_TAIL ? end - CKPT_TAIL : 0;
+    long pos = ftell(fl);
+
+    fseek(fl, start, SEEK_SET);
+    size_t got = fread(buffer, 1, end - start, fl);
+    fseek(fl, pos, SEEK_SET);
+    return fnv64(buffer, got);
+}
+
+unsigned long long fnv64(const uchar8 *buf, size_t len) // FNV-1a
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++)
+        hash = (hash ^ buf[i]) * 1099511628211ULL;
+    return hash;
+}
+
+long long fileStamp(const char *fname)
+{
+    struct stat st;
+    if(stat(fname, &st) != 0)
+        return 0;
+    return (long long) st.st_mtime;
+}
+
+int syncFile(FILE *fl)
+{
+    if(fflush(fl) != 0)
+        return -1;
+#ifdef _WIN32
+    return _commit(_fileno(fl));
+#else
+    return fdatasync(fileno(fl));
+#endif
+}
+
+// a rename or a new file only survives a crash once the directory entry
+// is on disk too, and fsyncing the file doesn't do that
+int syncDir(const char *path)
+{
+#ifdef _WIN32
+    return 0; // NTFS commits its metadata on its own, there's nothing to open
+#else
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    if(!slash)
+        strcpy(dir, ".");
+    else if(slash == dir)
+        dir[1] = '\0'; // the root
+    else
+        *slash = '\0';
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    int status = fd < 0 || fsync(fd) != 0 ? -1 : 0;
+    if(fd >= 0)
+        close(fd);
+    free(dir);
+    return status;
+#endif
+}
+
+// journals and layout files are never rewritten in place: the new one is
+// written to name.tmp and synced, renamed over name, and the directory is
+// synced, so the caller only goes on once the new version is for sure
+// what a crash would leave behind. replaceEnd takes the result of
+// replaceBegin (NULL included) and always frees tmpname.
+FILE *replaceBegin(const char *name, char **tmpname)
+{
+    *tmpname = (char *) calloc(strlen(name) + strlen(".tmp") + 1, sizeof(char));
+    strcpy(*tmpname, name);
+    strcat(*tmpname, ".tmp");
+    return fopen(*tmpname, "wb");
+}
+
+int replaceEnd(FILE *fl, char *tmpname, const char *name)
+{
+    int status = fl && !ferror(fl) && syncFile(fl) == 0 ? 0 : -1;
+    if(fl && fclose(fl) != 0)
+        status = -1;
+#ifdef _WIN32
+    if(status == 0)
+        remove(name); // windows won't rename over an existing file
+#endif
+    if(status == 0 && (rename(tmpname, name) != 0 || syncDir(name) != 0))
+        status = -1;
+    if(status != 0)
+        remove(tmpname);
+    free(tmpname);
+    return status;
+}
+
+int truncFile(FILE *fl, uint32 size)
+{
+    if(fflush(fl) != 0)
+        return -1;
+#ifdef _WIN32
+    return _chsize_s(_fileno(fl), size);
+#else
+    return ftruncate(fileno(fl), size);
+#endif
+}
+
+static uchar8 *alignedAlloc(size_t size)
+{
+#ifdef _WIN32
+    return (uchar8 *) _aligned_malloc(size, DIRECT_ALIGN);
+#else
+    void *p;
+    return posix_memalign(&p, DIRECT_ALIGN, size) == 0 ? (uchar8 *) p : NULL;
+#endif
+}
+
+static void alignedFree(uchar8 *p, size_t size, int locked)
+{
+    if(locked)
+        sodium_munlock(p, size);
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+static size_t classSize(int c)
+{
+    if(c == POOL_POW2)
+        return XOR_BLOCK;
+    if(c == POOL_POW2 + 1)
+        return PACK_BLOCK;
+    return (size_t) 1 << (POOL_SHIFT + c);
+}
+
+// the engine blocks get classes of their own, anything else is rounded
+// up to a power of two. -1 = bigger than any class, not kept.
+static int poolClass(size_t size)
+{
+    int c = 0;
+
+    if(size == XOR_BLOCK)
+        return POOL_POW2;
+    if(size == PACK_BLOCK)
+        return POOL_POW2 + 1;
+    while(c < POOL_POW2 && classSize(c) < size)
+        c++;
+    return c < POOL_POW2 ? c : -1;
+}
+
+// frees one kept buffer; 0 if there was none
+static int poolShrink(void)
+{
+    for(int locked = 0; locked < 2; locked++)
+        for(int c = 0; c < POOL_CLASSES; c++)
+        {
+            uchar8 *p = pool.free[locked][c];
+            if(!p)
+                continue;
+            memcpy(&pool.free[locked][c], p, sizeof(uchar8 *));
+            pool.used -= classSize(c);
+            alignedFree(p, classSize(c), locked);
+            return 1;
+        }
+    return 0;
+}
+
+// buffers are DIRECT_ALIGN aligned (fine for O_DIRECT and any SIMD).
+// key material is wiped when it comes back and, with --lock-keys, locked
+// into RAM. with --max-memory, a thread that would go over the cap waits
+// for others to give buffers back. a thread can only wait if somebody
+// who isn't waiting still holds buffers, otherwise nobody would ever
+// wake it up, so instead the request fails. key cache entries (key has
+// POOL_CACHED set) count toward the cap but belong to no thread, so they
+// never wait: if there's no room, the key just isn't cached.
+uchar8 *bufGet(size_t size, int key)
+{
+    int cached  = (key & POOL_CACHED) != 0;
+    int locked  = cached ? (key & POOL_LOCKED) != 0 : key && opts.lockKeys;
+    int c       = poolClass(size);
+    uchar8 *p   = NULL;
+
+    if(c >= 0)
+        size = classSize(c);
+    pthread_mutex_lock(&pool.lock);
+    while(!p)
+    {
+        if(c >= 0 && pool.free[locked][c])
+        {
+            p = pool.free[locked][c];
+            memcpy(&pool.free[locked][c], p, sizeof(uchar8 *));
+            break;
+        }
+        while(pool.cap && pool.used + size > pool.cap && poolShrink())
+            ;
+        if(!pool.cap || pool.used + size <= pool.cap)
+        {
+            if(!(p = alignedAlloc(size)))
+                break;
+            pool.used += size;
+            if(locked && sodium_mlock(p, size) != 0)
+                printf("\rWarning: couldn't lock key material into memory.\n");
+            break;
+        }
+        if(cached || size > pool.cap 
+            || (held > 0 && pool.waiting >= pool.holders - 1))
+            break;
+        pool.waiting += held > 0; // bufPut wakes everybody and resets it
+        for(unsigned gen = pool.gen; gen == pool.gen; )
+            pthread_cond_wait(&pool.freed, &pool.lock);
+    }
+
+    if(p && !cached)
+    {
+        pool.holders += held == 0;
+        held += size;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if(!p && !cached)
+        printf("\rError: not enough memory%s.\n", pool.cap ? " within --max-memory" : "");
+    return p;
+}
+
+void bufPut(uchar8 *p, size_t size, int key)
+{
+    int cached  = (key & POOL_CACHED) != 0;
+    int locked  = cached ? (key & POOL_LOCKED) != 0 : key && opts.lockKeys;
+    int c       = poolClass(size);
+
+    if(!p)
+        return;
+    if(c >= 0)
+        size = classSize(c);
+    if(key)
+        sodium_memzero(p, size);
+
+    pthread_mutex_lock(&pool.lock);
+    if(!cached)
+    {
+        held -= size;
+        pool.holders -= held == 0;
+    }
+    if(c >= 0) // kept for the next one who needs this class
+    {
+        memcpy(p, &pool.free[locked][c], sizeof(uchar8 *));
+        pool.free[locked][c] = p;
+    }
+    else
+    {
+        pool.used -= size;
+        alignedFree(p, size, locked);
+    }
+    pool.waiting = 0;
+    pool.gen++;
+    pthread_cond_broadcast(&pool.freed);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+uint32 parseSize(const char *str) // 50M = 50 * 2^20
+{
+    char *end;
+    uint32 n = strtoul(str, &end, 10);
+    switch(toupper((uchar8) *end))
+    {
+        case 'G': n <<= 10; // fall through
+        case 'M': n <<= 10; // fall through
+        case 'K': n <<= 10;
+    }
+    return n;
+}
+
+#ifndef _WIN32
+// I/O policy for sharing a box: every read or write of the engines goes
+// through ioPace. --max-rate and --max-iops are token buckets holding a
+// quarter second worth of I/O; when one runs dry we sleep until it has
+// refilled. the page cache gets hints once per CACHE_WINDOW: inputs are
+// read ahead a window at a time and, with --no-cache, dropped behind us.
+// outputs are pushed to disk a window behind the frontier and dropped
+// from the cache once they're there, so dirty pages never pile up.
+static double monoTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void throttle(uint32 len)
+{
+    double now = monoTime();
+    double wait = 0.0;
+
+    if(bucket.last == 0.0) // a full bucket to start with
+    {
+        bucket.bytes = opts.maxRate / 4.0;
+        bucket.ios = opts.maxIops / 4.0;
+        bucket.last = now;
+    }
+    if(opts.maxRate)
+    {
+        bucket.bytes += (now - bucket.last) * opts.maxRate;
+        if(bucket.bytes > opts.maxRate / 4.0)
+            bucket.bytes = opts.maxRate / 4.0;
+        bucket.bytes -= len;
+        if(bucket.bytes < 0 && -bucket.bytes / opts.maxRate > wait)
+            wait = -bucket.bytes / opts.maxRate;
+    }
+    if(opts.maxIops)
+    {
+        bucket.ios += (now - bucket.last) * opts.maxIops;
+        if(bucket.ios > opts.maxIops / 4.0)
+            bucket.ios = opts.maxIops / 4.0;
+        bucket.ios -= 1;
+        if(bucket.ios < 0 && -bucket.ios / opts.maxIops > wait)
+            wait = -bucket.ios / opts.maxIops;
+    }
+    bucket.last = now;
+
+    if(wait > 0.0)
+    {
+        struct timespec ts = { (time_t) wait, (long) ((wait - (time_t) wait) * 1e9) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+void ioPace(FILE *fl, uint32 len, int writing)
+{
+    if(opts.maxRate || opts.maxIops)
+        throttle(len);
+
+    int fd = fl ? fileno(fl) : -1; // cookie streams (stripes, --direct) have none
+    if(fd < 0)
+        return;
+    off_t pos = ftello(fl); // the frontier, stdio buffer included
+    off_t win = pos / CACHE_WINDOW;
+    if(pos < 0 || win == (pos - (off_t) len) / (off_t) CACHE_WINDOW)
+        return; // still in the same window
+
+    if(!writing)
+    {
+        posix_fadvise(fd, win * CACHE_WINDOW, CACHE_WINDOW, POSIX_FADV_WILLNEED);
+        if(opts.nocache && win >= 1)
+            posix_fadvise(fd, 0, (win - 1) * CACHE_WINDOW, POSIX_FADV_DONTNEED);
+    }
+    else if(opts.nocache && fflush(fl) == 0)
+    {
+#ifdef __linux__
+        // start writing the window we just left, wait for the one before it
+        sync_file_range(fd, (win - 1) * CACHE_WINDOW, CACHE_WINDOW, 
+                        SYNC_FILE_RANGE_WRITE);
+        if(win >= 2)
+            sync_file_range(fd, (win - 2) * CACHE_WINDOW, CACHE_WINDOW, 
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE 
+                            | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+        if(win >= 2)
+            posix_fadvise(fd, (win - 2) * CACHE_WINDOW, CACHE_WINDOW, 
+                        POSIX_FADV_DONTNEED);
+    }
+}
+
+// --no-cache: the last windows of a file go once the engine is done with it
+void ioDone(FILE *fl)
+{
+    int fd = fl ? fileno(fl) : -1;
+    if(!opts.nocache || fd < 0 || fflush(fl) != 0)
+        return;
+#ifdef __linux__
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE 
+                    | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+void idlePriority(void)
+{
+#ifdef SYS_ioprio_set
+    // IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE; there's no header for these
+    if(syscall(SYS_ioprio_set, 1, 0, 3 << 13) != 0)
+        printf("Warning: couldn't switch to the idle I/O class.\n");
+#endif
+    if(setpriority(PRIO_PROCESS, 0, 19) != 0)
+        printf("Warning: couldn't lower the CPU priority.\n");
+}
+
+// --direct: O_DIRECT needs aligned buffers, offsets and sizes, so inputs
+// are read DIRECT_BUF at a time into an aligned buffer and handed out
+// from there. the page cache never sees them.
+static ssize_t directRead(void *cookie, char *buf, size_t size)
+{
+    DIRECTIN *d = (DIRECTIN *) cookie;
+    size_t done = 0;
+
+    while(done < size)
+    {
+        if(d->pos < d->bufoff || d->pos >= d->bufoff + (off64_t) d->buflen)
+        {
+            d->bufoff = d->pos & ~((off64_t) DIRECT_ALIGN - 1);
+            ssize_t got = pread(d->fd, d->buf, DIRECT_BUF, d->bufoff);
+            if(got < 0)
+                return -1;
+            d->buflen = got;
+            if(d->pos >= d->bufoff + got)
+                break; // end of file
+        }
+        size_t take = d->bufoff + d->buflen - d->pos;
+        if(take > size - done)
+            take = size - done;
+        memcpy(buf + done, d->buf + (d->pos - d->bufoff), take);
+        d->pos += take;
+        done += take;
+    }
+    return done;
+}
+
+static int directSeek(void *cookie, off64_t *offset, int whence)
+{
+    DIRECTIN *d = (DIRECTIN *) cookie;
+    struct stat st;
+    off64_t target = *offset;
+
+    if(whence == SEEK_CUR)
+        target += d->pos;
+    else if(whence == SEEK_END)
+    {
+        if(fstat(d->fd, &st) != 0)
+            return -1;
+        target += st.st_size;
+    }
+    if(target < 0)
+        return -1;
+    d->pos = *offset = target;
+    return 0;
+}
+
+static int directClose(void *cookie)
+{
+    DIRECTIN *d = (DIRECTIN *) cookie;
+    int error = close(d->fd);
+    bufPut(d->buf, DIRECT_BUF, 0);
+    free(d);
+    return error;
+}
+
+FILE *openRead(const char *fname)
+{
+    cookie_io_functions_t io = { directRead, NULL, directSeek, directClose };
+    int fd = opts.direct ? open(fname, O_RDONLY | O_DIRECT) : -1;
+    FILE *fl;
+
+    if(fd < 0) // not asked for, or the file system can't do it
+    {
+        if(opts.direct && errno != EINVAL)
+            return NULL;
+        if((fl = fopen(fname, "rb")))
+            posix_fadvise(fileno(fl), 0, 0, POSIX_FADV_SEQUENTIAL);
+        return fl;
+    }
+
+    DIRECTIN *d = (DIRECTIN *) calloc(1, sizeof(DIRECTIN));
+    d->fd = fd;
+    if(!(d->buf = bufGet(DIRECT_BUF, 0)) || !(fl = fopencookie(d, "r", io)))
+    {
+        bufPut(d->buf, DIRECT_BUF, 0);
+        free(d);
+        close(fd);
+        return NULL;
+    }
+    return fl;
+}
+#else
+void ioPace(FILE *fl, uint32 len, int writing)
+{
+}
+
+void ioDone(FILE *fl)
+{
+}
+
+void idlePriority(void)
+{
+}
+
+FILE *openRead(const char *fname)
+{
+    return fopen(fname, "rb");
+}
+#endif
+
+// --in-place: the file is rewritten one IP_BLOCK at a time. before a block
+// is written, the encrypted side of it goes to journal_<file> (synced,
+// renamed into place), and the block before it is synced first. that's
+// the result when encrypting and the original when decrypting, so the
+// plaintext never lands in the journal. after a crash the journal block is
+// written back and the job goes on after it (or from it, when decrypting).
+int vigInPlace(const char *fname, KEYSTREAM *ks, const char *mode)
+{
+    FILE *fl = fopen(fname, "r+b");
+    if(!fl)
+    {
+        printf("Unable to open file %s for writing. Does it exist?\n", fname);
+        return -66;
+    }
+
+    char *jname         = prefixName("journal_", fname);
+    const uint32 size   = fileSize(fl);
+    uchar8 *block       = bufGet(2 * IP_BLOCK, 1);
+    uint32 done         = 0;
+    uint32 want         = 0;
+    uint32 speed        = 0;
+    uint32 unix         = (uint32) time(NULL);
+    const int encrypting = strcmp(mode, "encvig") == 0;
+    int status          = block ? replayBlock(jname, mode, fl, size, block, &done) 
+                        : -79;
+
+    ks->scratch = block ? block + IP_BLOCK : NULL;
+    if(status > 0)
+        status = 0;
+    if(status == 0 && !opts.quiet)
+        printf("Progress: [00.00%%]");
+    fflush(stdout);
+    while(status == 0 && done < size)
+    {
+        want = size - done < IP_BLOCK ? size - done : IP_BLOCK;
+        fseek(fl, done, SEEK_SET);
+        if(fread(block, 1, want, fl) != want)
+        {
+            printf("\rError: couldn't read %s.\n", fname);
+            status = -67;
+            break;
+        }
+        ioPace(NULL, want, 0); // cache hints come with the write
+        if(done > 0 && syncFile(fl) != 0) // previous block must stick first
+        {
+            printf("\rError: couldn't flush %s to disk.\n", fname);
+            status = -84;
+            break;
+        }
+
+        ks->vpos = done % ks->vlen; // the key just repeats, so we can seek in it
+        if(encrypting)
+            keyXor(ks, block, want);
+        if((status = journalBlock(jname, mode, size, done, want, 
+                encrypting ? done + want : done, block)) != 0)
+            break;
+        if(!encrypting)
+            keyXor(ks, block, want);
+        fseek(fl, done, SEEK_SET);
+        if(fwrite(block, 1, want, fl) != want)
+        {
+            printf("\rError: couldn't write %s.\n", fname);
+            status = -68;
+            break;
+        }
+        ioPace(fl, want, 1);
+
+        done += want;
+        speed += want;
+        if(unix < (uint32) time(NULL))
+        {
+            unix = progress(done, size, speed);
+            speed = 0;
+        }
+    }
+
+    if(status == 0 && syncFile(fl) != 0)
+    {
+        printf("\rError: couldn't flush %s to disk.\n", fname);
+        status = -84;
+    }
+    if(status == 0)
+        remove(jname);
+
+    ioDone(fl);
+    fclose(fl);
+    free(jname);
+    bufPut(block, 2 * IP_BLOCK, 1);
+    ks->scratch = NULL;
+    return status;
+}
+
+// next is where to carry on once the block is back in the file
+int journalBlock(const char *jname, const char *mode, uint32 size, uint32 offset, 
+                uint32 len, uint32 next, const uchar8 *block)
+{
+    char *tmpname;
+    FILE *fl = replaceBegin(jname, &tmpname);
+    if(fl)
+    {
+        fprintf(fl, "AVPES block %s %lu %lu %lu %lu %llx\n", mode, size, offset, 
+                len, next, fnv64(block, len));
+        fwrite(block, 1, len, fl); // a short write shows up in ferror
+    }
+    // the block may only be overwritten once this is on disk for sure
+    if(replaceEnd(fl, tmpname, jname) != 0)
+    {
+        printf("\rError: couldn't write the journal (%s).\n", jname);
+        return -85;
+    }
+    return 0;
+}
+
+// puts the block saved in the journal back; returns 1 and the offset to
+// continue from, 0 if there's no journal, or an error
+int replayBlock(const char *jname, const char *mode, FILE *fl, uint32 size, 
+                uchar8 *block, uint32 *offset)
+{
+    char header[128];
+    char jmode[16];
+    unsigned long jsize, joff, jlen, jnext;
+    unsigned long long jhash;
+
+    *offset = 0;
+    FILE *jfl = fopen(jname, "rb");
+    if(!jfl)
+        return 0;
+
+    if(!opts.resume)
+    {
+        printf("Found an unfinished job (%s). Run again with --resume, ", jname);
+        printf("or the file stays half-done.\n");
+        fclose(jfl);
+        return -80;
+    }
+
+    if(!fgets(header, sizeof(header), jfl) 
+        || sscanf(header, "AVPES block %15s %lu %lu %lu %lu %llx", 
+            jmode, &jsize, &joff, &jlen, &jnext, &jhash) != 6
+        || strcmp(jmode, mode) != 0 || jsize != size || jlen > IP_BLOCK 
+        || joff + jlen > size || (jnext != joff && jnext != joff + jlen)
+        || fread(block, 1, jlen, jfl) != jlen 
+        || fnv64(block, jlen) != jhash)
+    {
+        printf("%s doesn't belong to this job or is damaged.\n", jname);
+        fclose(jfl);
+        return -81;
+    }
+    fclose(jfl);
+
+    fseek(fl, joff, SEEK_SET);
+    if(fwrite(block, 1, jlen, fl) != jlen || syncFile(fl) != 0)
+    {
+        printf("Couldn't restore the interrupted block of the file.\n");
+        return -83;
+    }
+
+    *offset = jnext;
+    printf("Resuming from %.2f%%.\n", size ? 100.0 * jnext / size : 100.0);
+    return 1;
+}
+
+// key cache for the daemon: the letters of a key file are kept around and
+// handed out again as long as the file's stamp doesn't change. a job that
+// rewrites the key and submits right away must not get the old one, so
+// whole seconds aren't enough: the stamp has mtime and ctime down to the
+// nanosecond (ctime can't be set back by hand) and the inode, which
+// changes when a new file is renamed over the key.
+int keyStamp(FILE *keyfl, long long *stamp)
+{
+    struct stat st;
+
+    if(!keycache.enabled || fstat(fileno(keyfl), &st) != 0)
+        return -1;
+    stamp[0] = (long long) st.st_size;
+    stamp[1] = (long long) st.st_ino;
+#ifdef _WIN32
+    stamp[2] = (long long) st.st_mtime;
+    stamp[3] = 0;
+    stamp[4] = (long long) st.st_ctime;
+    stamp[5] = 0;
+#else
+    stamp[2] = (long long) st.st_mtim.tv_sec;
+    stamp[3] = (long long) st.st_mtim.tv_nsec;
+    stamp[4] = (long long) st.st_ctim.tv_sec;
+    stamp[5] = (long long) st.st_ctim.tv_nsec;
+#endif
+    return 0;
+}
+
+int cachedVigKey(const char *keyname, const long long *stamp, uchar8 *key, 
+                uint32 *keylen)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&keycache.lock);
+    for(VIGKEY *vk = keycache.keys; vk; vk = vk->next)
+        if(strcmp(vk->name, keyname) == 0 
+            && memcmp(vk->stamp, stamp, sizeof(vk->stamp)) == 0)
+        {
+            memcpy(key, vk->key, vk->len);
+            *keylen = vk->len;
+            vk->used = ++keycache.tick;
+            found = 1;
+            break;
+        }
+    pthread_mutex_unlock(&keycache.lock);
+    return found;
+}
+
+static void dropVigKey(VIGKEY *vk) // wipes it too
+{
+    bufPut(vk->key, vk->len + 1, vk->flags);
+    free(vk->name);
+    free(vk);
+}
+
+// entries come from the pool, so they count toward --max-memory. an old
+// copy of the key is replaced, and a full cache drops the entry that has
+// gone unused the longest.
+void storeVigKey(const char *keyname, const long long *stamp, const uchar8 *key, 
+                uint32 keylen)
+{
+    VIGKEY *vk, **link, **oldest = NULL;
+    int count = 0;
+
+    pthread_mutex_lock(&keycache.lock);
+    for(link = &keycache.keys; (vk = *link); )
+    {
+        if(strcmp(vk->name, keyname) == 0)
+        {
+            *link = vk->next;
+            dropVigKey(vk);
+            continue;
+        }
+        if(!oldest || vk->used < (*oldest)->used)
+            oldest = link;
+        count++;
+        link = &vk->next;
+    }
+    if(count >= KEY_CACHE)
+    {
+        vk = *oldest;
+        *oldest = vk->next;
+        dropVigKey(vk);
+    }
+
+    vk = (VIGKEY *) calloc(1, sizeof(VIGKEY));
+    vk->flags = POOL_CACHED | (opts.lockKeys ? POOL_LOCKED : 0);
+    vk->key = bufGet(keylen + 1, vk->flags);
+    if(vk->key)
+    {
+        vk->name = strdup(keyname);
+        memcpy(vk->key, key, keylen);
+        vk->len = keylen;
+        memcpy(vk->stamp, stamp, sizeof(vk->stamp));
+        vk->used = ++keycache.tick;
+        vk->next = keycache.keys;
+        keycache.keys = vk;
+    }
+    else
+        free(vk); // no room under --max-memory, the key goes uncached
+    pthread_mutex_unlock(&keycache.lock);
+}
+
+int runJob(int argc, char *argv[])
+{
+    int status;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&bucket, 0, sizeof(bucket));
+    opts.quiet = 1;
+    parseOpts(&argc, argv);
+    if(argc < 3)
+        return -99;
+    if((status = checkOpts(argv[1])) != 0)
+        return status;
+    if(opts.idle || opts.maxMemory) // process wide
+    {
+        printf("Job rejected: --idle and --max-memory go on --serve, not on jobs.\n");
+        return -89;
     }
 
-    if(ihead.biBitCount != 24)
+    if(strcmp(argv[1], "--encdef") == 0 && argc == 3)
+        return runEncDef(argv[2]);
+    else if(strcmp(argv[1], "--encvig") == 0 && argc == 4)
+        return runEncVig(argv[2], argv[3]);
+    else if(strcmp(argv[1], "--decdef") == 0 && argc == 4)
+        return runDecDef(argv[2], argv[3]);
+    else if(strcmp(argv[1], "--decvig") == 0 && argc == 4)
+        return runDecVig(argv[2], argv[3]);
+
+    printf("Job rejected: %s isn't a daemon mode or has the wrong arguments.\n", 
+            argv[1]);
+    return -99;
+}
+
+#ifndef _WIN32
+// --serve: one request per line, the arguments of a normal run separated
+// by tabs (mode first, absolute paths). every request gets a line back:
+// the status (0 or the error code) and how long the job took in ms.
+// a connection can send as many requests as it likes; each connection is
+// handled by one worker of the pool, so parallel jobs need parallel
+// connections.
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t room;
+    int fds[JOB_QUEUE];
+    int head;
+    int count;
+} jobq = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 
+            PTHREAD_COND_INITIALIZER, { 0 }, 0, 0 };
+
+static const char *sockname;
+
+static void stopServing(int sig)
+{
+    (void) sig;
+    unlink(sockname);
+    _exit(0);
+}
+
+static void *worker(void *unused)
+{
+    char line[JOB_LINE];
+    char *args[64];
+    struct timespec start, end;
+    (void) unused;
+
+    for(;;)
     {
-        printf("%s is not a 24-bit bitmap image.\n", bmpname);
-        fclose(bmp);
-        fclose(text);
-        exit(-26);
+        pthread_mutex_lock(&jobq.lock);
+        while(jobq.count == 0)
+            pthread_cond_wait(&jobq.ready, &jobq.lock);
+        int fd = jobq.fds[jobq.head];
+        jobq.head = (jobq.head + 1) % JOB_QUEUE;
+        jobq.count--;
+        pthread_cond_signal(&jobq.room);
+        pthread_mutex_unlock(&jobq.lock);
+
+        FILE *conn = fdopen(fd, "r");
+        while(conn && fgets(line, sizeof(line), conn))
+        {
+            // a request that didn't fit (or never ended) isn't run at all,
+            // not even the part that came in: its last path could be cut
+            if(!strchr(line, '\n'))
+            {
+                int c;
+                while((c = getc(conn)) != EOF && c != '\n')
+                    ;
+                if(dprintf(fd, "%d %.3f\n", -75, 0.0) < 0)
+                    break;
+                continue;
+            }
+
+            int argc = 1;
+            args[0] = "avpes";
+            char *save = NULL; // strtok isn't safe with several workers
+            line[strcspn(line, "\r\n")] = '\0';
+            for(char *tok = strtok_r(line, "\t", &save); tok && argc < 63; 
+                tok = strtok_r(NULL, "\t", &save))
+                args[argc++] = tok;
+            args[argc] = NULL;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            int status = runJob(argc, args);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double ms = (end.tv_sec - start.tv_sec) * 1000.0 
+                        + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+            if(dprintf(fd, "%d %.3f\n", status, ms) < 0)
+                break; // client went away
+        }
+        if(conn)
+            fclose(conn);
+        else
+            close(fd);
     }
-    
-    if(ihead.biCompression != 0)
+    return NULL;
+}
+
+int serve(const char *sockpath)
+{
+    struct sockaddr_un addr;
+    int nworkers = opts.workers > 0 ? opts.workers 
+                    : (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(sodium_init() < 0) // once for the whole pool
     {
-        printf("%s is not an uncompressed bitmap file.\n", bmpname);
-        fclose(bmp);
-        fclose(text);
-        exit(-56);
+        printf("Error initializing sodium.\n");
+        return -8;
+    }
+    if(strlen(sockpath) >= sizeof(addr.sun_path))
+    {
+        printf("Error: the socket path is too long.\n");
+        return -72;
     }
 
-    if(sizeText > ((fhead.bfSize - 54) / 4) - 9)
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockpath);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(sockpath); // left over from a previous daemon
+    mode_t mask = umask(077); // only our own user gets to send jobs
+    int bound = sock >= 0 && bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+    umask(mask);
+    if(!bound || listen(sock, 64) != 0)
     {
-        printf("This bitmap image is too small to encode your data in it.\n");
-        fclose(bmp);
-        fclose(text);
-        exit(-44);
+        printf("Error: couldn't listen on %s.\n", sockpath);
+        return -73;
+    }
+
+    sockname = sockpath;
+    setvbuf(stdout, NULL, _IOLBF, 0); // job errors end up in the daemon's log
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServing);
+    signal(SIGTERM, stopServing);
+    keycache.enabled = 1;
+
+    for(int i = 0; i < (nworkers > 0 ? nworkers : 1); i++)
+    {
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, worker, NULL) != 0)
+        {
+            printf("Error: couldn't start the worker threads.\n");
+            return -74;
+        }
+        pthread_detach(tid);
     }
+    printf("Serving on %s with %d workers.\n", sockpath, nworkers);
+    fflush(stdout);
 
-    // now we know the bitmap is usable, so we're good to go
+    for(;;)
+    {
+        int fd = accept(sock, NULL, NULL);
+        if(fd < 0)
+            continue;
+        pthread_mutex_lock(&jobq.lock);
+        while(jobq.count == JOB_QUEUE)
+            pthread_cond_wait(&jobq.room, &jobq.lock);
+        jobq.fds[(jobq.head + jobq.count) % JOB_QUEUE] = fd;
+        jobq.count++;
+        pthread_cond_signal(&jobq.ready);
+        pthread_mutex_unlock(&jobq.lock);
+    }
+}
 
+int submit(int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    char line[JOB_LINE] = "";
+    char dirs[JOB_LINE];
+    char path[PATH_MAX];
 
-    char *outname = (char *) calloc(strlen(bmpname) + strlen("encrypted_") + 1, 
-                    sizeof(char));
-    strcpy(outname, "encrypted_");
-    strcat(outname, bmpname);
-    FILE *outfile = fopen(outname, "wb");
-    if(!outfile)
+    if(argc < 5)
     {
-        printf("Unable to create encrypted bitmap.\n");
-        exit(-61);
+        printf("Error: Usage is avpes --submit [socket] [mode] [file] ...\n");
+        return -75;
+    }
+
+    // the daemon has its own working directory, so send absolute paths
+    for(int i = 3; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        int tooLong = 0;
+        if(i > 4 && (strcmp(argv[i - 1], "--stripe-enc") == 0 
+            || strcmp(argv[i - 1], "--stripe-key") == 0)) // each directory
+        {
+            char *copy = strdup(arg);
+            char *save = NULL;
+            dirs[0] = '\0';
+            for(char *d = strtok_r(copy, ",", &save); d; d = strtok_r(NULL, ",", &save))
+            {
+                const char *full = realpath(d, path) ? path : d;
+                tooLong |= strlen(dirs) + strlen(full) + 2 >= sizeof(dirs);
+                if(tooLong)
+                    break;
+                if(dirs[0])
+                    strcat(dirs, ",");
+                strcat(dirs, full);
+            }
+            free(copy);
+            arg = dirs;
+        }
+        else if(i > 3 && strncmp(arg, "--", 2) != 0 && realpath(arg, path))
+            arg = path;
+        if(tooLong || strlen(line) + strlen(arg) + 2 >= sizeof(line))
+        {
+            printf("Error: the request is too long.\n");
+            return -75;
+        }
+        if(i > 3)
+            strcat(line, "\t");
+        strcat(line, arg);
     }
+    strcat(line, "\n");
 
-    fwrite(&fhead, sizeof(fhead), 1, outfile);
-    fwrite(&ihead, sizeof(ihead), 1, outfile);
+    if(strlen(argv[2]) >= sizeof(addr.sun_path))
+    {
+        printf("Error: the socket path is too long.\n");
+        return -72;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[2]);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+    {
+        printf("Error: couldn't reach the daemon at %s.\n", argv[2]);
+        return -76;
+    }
 
-    short padding   = (4 - (ihead.biWidth * 3) % 4) % 4; // pure magic; 3 is sizeof(RGB)
-    uint32 fsize    = fileSize(bmp);
-    uint32 tsize    = fileSize(text);
-    uchar8 pxlbyte  = 0x0;
-    uchar8 txtbyte  = 0x0;
-    uchar8 modpxl   = 0x0;
-    uchar8 pxlbytef[9];
-    uchar8 txtbytef[9];
-    uint32 i, iterator;
-    int padcheckB, padcheckA;
-    uchar8 pad = 0x0;
-    char *wtv;
-    fseek(bmp, 54, SEEK_SET); // skip headers
+    int status = -77;
+    double ms = 0.0;
+    FILE *conn = fdopen(sock, "r");
+    if(write(sock, line, strlen(line)) != (ssize_t) strlen(line) 
+        || !fgets(line, sizeof(line), conn) 
+        || sscanf(line, "%d %lf", &status, &ms) != 2)
+    {
+        printf("Error: the daemon didn't answer.\n");
+        status = -77;
+    }
+    else if(status == 0)
+        printf("Job done in %.3f ms.\n", ms);
+    else
+        printf("Job failed with error %d after %.3f ms.\n", status, ms);
+    fclose(conn);
+    return status;
+}
+#else
+int serve(const char *sockpath)
+{
+    printf("Error: --serve needs unix sockets, it doesn't work on Windows.\n");
+    return -73;
+}
+
+int submit(int argc, char *argv[])
+{
+    printf("Error: --submit needs unix sockets, it doesn't work on Windows.\n");
+    return -76;
+}
+#endif
+
+char *keymapName(const char *fname)
+{
+    char *name = prefixName("keymap_", fname);
+    if(!opts.keymapDir)
+        return name;
+
+    // keymap_<file> without the directory, put into --keymap-dir
+    const char *slash = strrchr(fname, '/');
+    char *base = name + (slash ? (size_t) (slash + 1 - fname) : 0);
+    char *moved = (char *) calloc(strlen(opts.keymapDir) + strlen(base) + 2, 
+                sizeof(char));
+    strcpy(moved, opts.keymapDir);
+    strcat(moved, "/");
+    strcat(moved, base);
+    free(name);
+    return moved;
+}
 
+int isLayout(const char *fname)
+{
+    char head[sizeof(STRIPE_MAGIC)] = "";
+    FILE *fl = fopen(fname, "rb");
+    if(!fl)
+        return 0;
+    int found = fgets(head, sizeof(head), fl) && strcmp(head, STRIPE_MAGIC) == 0;
+    fclose(fl);
+    return found;
+}
 
-    //magic happens in this loop
-    for(i = 0, padcheckB = 1, padcheckA = 1, iterator = 0; 
-        i < tsize*4; i++, iterator++, padcheckA++)
+#ifndef _WIN32
+// striped files: a plain file at the usual name holds the layout (magic,
+// total size, unit size, shard paths) and the data goes round-robin into
+// <dir>/<name>.<n> one STRIPE_UNIT at a time. every shard has its own
+// thread that writes (or reads ahead) its units, so the devices work in
+// parallel. to the engines it's just another FILE *.
+static void *shardWriter(void *arg)
+{
+    SHARD *sh = (SHARD *) arg;
+    for(;;)
     {
-        if(i % 4 == 0)
+        pthread_mutex_lock(&sh->lock);
+        while(sh->count == 0 && !sh->done)
+            pthread_cond_wait(&sh->cond, &sh->lock);
+        if(sh->count == 0) // done and drained
         {
-            fread(&txtbyte, 1, 1, text);
-            byteFormat(txtbytef, txtbyte);
-            padcheckB++;
-            iterator = 0;
+            pthread_mutex_unlock(&sh->lock);
+            break;
         }
+        uchar8 *buf = sh->bufs[sh->head];
+        uint32 len = sh->lens[sh->head];
+        pthread_mutex_unlock(&sh->lock);
+
+        // the slot stays ours until count goes down
+        int failed = fwrite(buf, 1, len, sh->fl) != len;
+
+        pthread_mutex_lock(&sh->lock);
+        sh->error |= failed;
+        sh->head = (sh->head + 1) % STRIPE_DEPTH;
+        sh->count--;
+        pthread_cond_broadcast(&sh->cond);
+        pthread_mutex_unlock(&sh->lock);
+    }
+    return NULL;
+}
+
+static void *shardReader(void *arg)
+{
+    SHARD *sh = (SHARD *) arg;
+    STRIPE *set = sh->set;
+    uint32 units = (set->size + set->unit - 1) / set->unit;
+    uint32 u = set->first / set->unit;
+
+    u += (sh->index - u % set->n + set->n) % set->n; // our first unit
+    fseek(sh->fl, (u / set->n) * set->unit, SEEK_SET);
+    for(; u < units; u += set->n)
+    {
+        uint32 len = u == units - 1 ? set->size - u * set->unit : set->unit;
+
+        pthread_mutex_lock(&sh->lock);
+        while(sh->count == STRIPE_DEPTH && !sh->stop)
+            pthread_cond_wait(&sh->cond, &sh->lock);
+        int slot = (sh->head + sh->count) % STRIPE_DEPTH;
+        int stop = sh->stop;
+        pthread_mutex_unlock(&sh->lock);
+        if(stop)
+            break;
+
+        int failed = fread(sh->bufs[slot], 1, len, sh->fl) != len;
+
+        pthread_mutex_lock(&sh->lock);
+        sh->lens[slot] = len;
+        sh->error |= failed;
+        if(!failed)
+            sh->count++;
+        pthread_cond_broadcast(&sh->cond);
+        pthread_mutex_unlock(&sh->lock);
+        if(failed)
+            break;
+    }
+
+    pthread_mutex_lock(&sh->lock);
+    sh->done = 1;
+    pthread_cond_broadcast(&sh->cond);
+    pthread_mutex_unlock(&sh->lock);
+    return NULL;
+}
+
+static int startShards(STRIPE *set)
+{
+    set->first = set->pos;
+    for(int i = 0; i < set->n; i++)
+    {
+        SHARD *sh = &set->shards[i];
+        if(pthread_create(&sh->tid, NULL, set->writing ? shardWriter 
+            : shardReader, sh) != 0)
+            return -1;
+        sh->running = 1;
+    }
+    set->started = 1;
+    return 0;
+}
+
+static int handOver(STRIPE *set) // the unit in cur goes to its shard's queue
+{
+    SHARD *sh = &set->shards[(set->pos / set->unit) % set->n];
+    pthread_mutex_lock(&sh->lock);
+    while(sh->count == STRIPE_DEPTH)
+        pthread_cond_wait(&sh->cond, &sh->lock);
+    int slot = (sh->head + sh->count) % STRIPE_DEPTH;
+    int error = sh->error;
+    uchar8 *spare = sh->bufs[slot];
+    sh->bufs[slot] = set->cur;
+    sh->lens[slot] = set->curlen;
+    sh->count++;
+    pthread_cond_broadcast(&sh->cond);
+    pthread_mutex_unlock(&sh->lock);
+
+    set->cur = spare;
+    set->pos += set->curlen;
+    set->curlen = 0;
+    return error;
+}
 
-        fread(&pxlbyte, 1, 1, bmp);
-        byteFormat(pxlbytef, pxlbyte);
+static ssize_t stripeWrite(void *cookie, const char *buf, size_t size)
+{
+    STRIPE *set = (STRIPE *) cookie;
+    size_t done = 0;
 
-        pxlbytef[6] = txtbytef[iterator];
-        pxlbytef[7] = txtbytef[++iterator];
+    while(done < size)
+    {
+        uint32 take = set->unit - set->curlen;
+        if(take > size - done)
+            take = size - done;
+        memcpy(set->cur + set->curlen, buf + done, take);
+        set->curlen += take;
+        done += take;
+
+        if(set->curlen == set->unit && handOver(set) != 0)
+            return 0;
+    }
+    set->size += size;
+    return size;
+}
 
-        modpxl = strtol(pxlbytef, &wtv, 2);
-        fwrite(&modpxl, 1, 1, outfile);
+static ssize_t stripeRead(void *cookie, char *buf, size_t size)
+{
+    STRIPE *set = (STRIPE *) cookie;
+    size_t done = 0;
 
-        if(padcheckB == ihead.biWidth * 3)
+    if(!set->started && startShards(set) != 0)
+        return -1;
+    while(done < size && set->pos < set->size)
+    {
+        if(set->curoff == set->curlen) // next unit, from whichever shard has it
         {
-            fseek(bmp, padding, SEEK_CUR); // skip padding
-            padcheckB = 1;
+            SHARD *sh = &set->shards[(set->pos / set->unit) % set->n];
+            pthread_mutex_lock(&sh->lock);
+            while(sh->count == 0 && !sh->done)
+                pthread_cond_wait(&sh->cond, &sh->lock);
+            if(sh->count == 0)
+            {
+                pthread_mutex_unlock(&sh->lock);
+                return -1; // shard is short or unreadable
+            }
+            uchar8 *full = sh->bufs[sh->head];
+            sh->bufs[sh->head] = set->cur;
+            set->curlen = sh->lens[sh->head];
+            sh->head = (sh->head + 1) % STRIPE_DEPTH;
+            sh->count--;
+            pthread_cond_broadcast(&sh->cond);
+            pthread_mutex_unlock(&sh->lock);
+            set->cur = full;
+            set->curoff = set->pos % set->unit; // only non-zero at the start
         }
 
-        if(padcheckA == ihead.biWidth * 3)
+        uint32 take = set->curlen - set->curoff;
+        if(take > size - done)
+            take = size - done;
+        memcpy(buf + done, set->cur + set->curoff, take);
+        set->curoff += take;
+        set->pos += take;
+        done += take;
+    }
+    return done;
+}
+
+static int stripeSeek(void *cookie, off64_t *offset, int whence)
+{
+    STRIPE *set = (STRIPE *) cookie;
+    off64_t target = *offset;
+
+    if(whence == SEEK_CUR)
+        target += set->writing ? set->size : set->pos;
+    else if(whence == SEEK_END)
+        target += set->size;
+
+    // the shards are read strictly in order, so we can only jump around
+    // before the first read (a resumed job skipping what's done)
+    off64_t here = set->writing ? set->size : set->pos;
+    if(target < 0 || (target != here 
+        && (set->writing || set->started || target > (off64_t) set->size)))
+        return -1;
+    if(!set->writing)
+        set->pos = target;
+    *offset = target;
+    return 0;
+}
+
+static void freeStripe(STRIPE *set)
+{
+    for(int i = 0; i < set->n; i++)
+    {
+        SHARD *sh = &set->shards[i];
+        for(int j = 0; j < STRIPE_DEPTH; j++)
+            bufPut(sh->bufs[j], STRIPE_UNIT, 0);
+        free(sh->path);
+        pthread_mutex_destroy(&sh->lock);
+        pthread_cond_destroy(&sh->cond);
+    }
+    bufPut(set->cur, STRIPE_UNIT, 0);
+    free(set->name);
+    free(set);
+}
+
+static int stripeClose(void *cookie)
+{
+    STRIPE *set = (STRIPE *) cookie;
+    int error = 0;
+
+    if(set->writing && set->curlen > 0) // short last unit
+        error |= handOver(set);
+
+    for(int i = 0; i < set->n; i++)
+    {
+        SHARD *sh = &set->shards[i];
+        pthread_mutex_lock(&sh->lock);
+        if(set->writing)
+            sh->done = 1; // writer drains what's queued, then stops
+        sh->stop = 1;
+        pthread_cond_broadcast(&sh->cond);
+        pthread_mutex_unlock(&sh->lock);
+        if(sh->running)
+            pthread_join(sh->tid, NULL);
+        error |= sh->error;
+        if(set->writing && (syncFile(sh->fl) != 0))
+            error = 1;
+        if(fclose(sh->fl) != 0)
+            error = 1;
+    }
+
+    // the layout file goes last: without it the shards don't count
+    if(set->writing && !set->failed && !error)
+    {
+        char *tmpname;
+        FILE *fl = replaceBegin(set->name, &tmpname);
+        if(fl)
+        {
+            fprintf(fl, "%s%lu\n%lu\n%d\n", STRIPE_MAGIC, set->size, set->unit, 
+                    set->n);
+            for(int i = 0; i < set->n; i++)
+                fprintf(fl, "%s\n", set->shards[i].path);
+        }
+        if(replaceEnd(fl, tmpname, set->name) != 0)
         {
-            fwrite(&pad, 1, padding, outfile);
-            padcheckA = 1;
+            printf("\rError: couldn't write the layout file (%s).\n", set->name);
+            error = 1;
         }
     }
 
-    while(fread(&pxlbyte, 1, 1, bmp) == 1) // do the rest of it
-        fwrite(&pxlbyte, 1, 1, outfile);
+    freeStripe(set);
+    return error ? -1 : 0;
+}
 
-    printf("%d bytes have been altered and written to %s.\n", tsize, outname);
+static STRIPE *newStripe(const char *name, int writing)
+{
+    STRIPE *set = (STRIPE *) calloc(1, sizeof(STRIPE));
+    set->writing = writing;
+    set->unit = STRIPE_UNIT;
+    set->name = strdup(name);
+    set->cur = bufGet(STRIPE_UNIT, 0);
+    for(int i = 0; i < STRIPE_MAX; i++)
+    {
+        set->shards[i].set = set;
+        set->shards[i].index = i;
+    }
+    return set;
+}
 
-    free(outname);
-    fclose(outfile);
-    fclose(bmp);
-    fclose(text);
+static int addShard(STRIPE *set, const char *path)
+{
+    SHARD *sh = &set->shards[set->n];
+    sh->path = strdup(path);
+    sh->fl = set->writing ? fopen(path, "wb") : openRead(path);
+    if(!sh->fl)
+    {
+        printf("Error: couldn't open the stripe %s.\n", path);
+        free(sh->path);
+        return -1;
+    }
+    pthread_mutex_init(&sh->lock, NULL);
+    pthread_cond_init(&sh->cond, NULL);
+    int ok = set->cur != NULL;
+    for(int j = 0; j < STRIPE_DEPTH; j++)
+        if(!(sh->bufs[j] = bufGet(STRIPE_UNIT, 0)))
+            ok = 0;
+    set->n++; // freeStripe gives back whatever we got
+    return ok ? 0 : -1;
 }
 
-void decBmp(const char *fname, const uint32 amount)
+FILE *openOutput(const char *fname, const char *dirs, STRIPE **sp)
 {
-    FILE *bmp = fopen(fname, "rb");
-    if(!bmp)
+    cookie_io_functions_t io = { NULL, stripeWrite, stripeSeek, stripeClose };
+    char path[PATH_MAX];
+
+    *sp = NULL;
+    if(!dirs)
+        return fopen(fname, "w+b");
+
+    // shards are named after the output file, minus its directory
+    const char *base = strrchr(fname, '/') ? strrchr(fname, '/') + 1 : fname;
+    char *list = strdup(dirs);
+    char *save = NULL;
+    STRIPE *set = newStripe(fname, 1);
+    remove(fname); // an old layout file would claim the new shards are done
+
+    for(char *dir = strtok_r(list, ",", &save); dir; 
+        dir = strtok_r(NULL, ",", &save))
     {
-        printf("Couldn't open bmp file.\n");
-        exit(-35);
+        char *full = realpath(dir, NULL); // the layout must work from anywhere
+        snprintf(path, sizeof(path), "%s/%s.%d", full ? full : dir, base, set->n);
+        free(full);
+        if(set->n == STRIPE_MAX || addShard(set, path) != 0)
+        {
+            if(set->n == STRIPE_MAX)
+                printf("Error: no more than %d stripes, please.\n", STRIPE_MAX);
+            for(int i = 0; i < set->n; i++)
+                fclose(set->shards[i].fl);
+            freeStripe(set);
+            free(list);
+            return NULL;
+        }
     }
+    free(list);
 
-    BITMAPFILEHEADER fhead;
-    BITMAPINFOHEADER ihead;
-    fread(&fhead, sizeof(BITMAPFILEHEADER), 1, bmp);
-    fread(&ihead, sizeof(BITMAPINFOHEADER), 1, bmp);
-    fseek(bmp, 54, SEEK_SET); // just in case, i dunno
+    FILE *fl = set->n > 0 && startShards(set) == 0 
+                ? fopencookie(set, "w", io) : NULL;
+    if(!fl)
+    {
+        set->failed = 1;
+        stripeClose(set);
+        return NULL;
+    }
+    *sp = set;
+    return fl;
+}
 
-    if(amount > ((fhead.bfSize / 4) - 54))
+FILE *openInput(const char *fname)
+{
+    cookie_io_functions_t io = { stripeRead, NULL, stripeSeek, stripeClose };
+    char line[PATH_MAX + 2];
+    unsigned long size, unit;
+    int n;
+
+    if(!isLayout(fname))
+        return openRead(fname);
+
+    FILE *layout = fopen(fname, "r");
+    STRIPE *set = newStripe(fname, 0);
+    int ok = fgets(line, sizeof(line), layout) 
+            && fscanf(layout, "%lu %lu %d ", &size, &unit, &n) == 3 
+            && unit == STRIPE_UNIT && n > 0 && n <= STRIPE_MAX;
+    set->size = size;
+
+    uint32 total = 0;
+    for(int i = 0; ok && i < n; i++)
     {
-        printf("The number of bytes to extract is too large.\n");
-        fclose(bmp);
-        exit(-355);
+        ok = fgets(line, sizeof(line), layout) != NULL;
+        line[strcspn(line, "\n")] = '\0';
+        ok = ok && addShard(set, line) == 0;
+        if(ok)
+            total += fileSize(set->shards[i].fl);
+    }
+    fclose(layout);
+
+    if(!ok || total != set->size) // a shard missing, short or from elsewhere
+    {
+        printf("Error: the stripes listed in %s are incomplete.\n", fname);
+        for(int i = 0; i < set->n; i++)
+            fclose(set->shards[i].fl);
+        freeStripe(set);
+        return NULL;
     }
 
-    if(fhead.bfType != 0x4d42)
+    // the reader threads start on the first read, after any seek
+    FILE *fl = fopencookie(set, "r", io);
+    if(!fl)
+        stripeClose(set);
+    return fl;
+}
+#else
+FILE *openOutput(const char *fname, const char *dirs, STRIPE **sp)
+{
+    *sp = NULL;
+    if(!dirs)
+        return fopen(fname, "w+b");
+    printf("Error: striping doesn't work on Windows.\n");
+    return NULL;
+}
+
+FILE *openInput(const char *fname)
+{
+    if(!isLayout(fname))
+        return openRead(fname);
+    printf("Error: striped files can't be read on Windows.\n");
+    return NULL;
+}
+#endif
+
+void chain(const char *spec, const char *fname)
+{
+    uint32 embedded = 0;
+    int status = runChain(spec, fname, &embedded);
+    if(status != 0)
+        exit(status);
+
+    CHAINSTAGE st[CHAIN_MAX];
+    char *list = strdup(spec);
+    int n = parseChain(list, st); // went fine in runChain already
+
+    printf("\rChain completed.                      \n");
+    if(st[n - 1].kind == CH_ENCBMP)
+        printf("%lu bytes have been embedded, extract them with decbmp:%lu.\n", 
+                embedded, embedded);
+    for(int i = 0; i < n; i++)
+        if(st[i].kind == CH_ENCDEF)
+        {
+            char *keyname = keymapName(fname);
+            printf("Keymap file: %s\n", keyname);
+            free(keyname);
+        }
+    free(list);
+    if(st[0].kind < CH_DECBMP)
+        ask(fname, pathSize(fname));
+    else
+        printf("All done.\n");
+}
+
+int parseChain(char *list, CHAINSTAGE *st)
+{
+    static const char *names[] = { "compress", "encdef", "encvig", "encbmp", 
+                                    "decbmp", "decdef", "decvig", "decompress" };
+    char *save = NULL;
+    int n = 0;
+    int keymaps = 0;
+
+    for(char *s = strtok_r(list, ",", &save); s; s = strtok_r(NULL, ",", &save))
     {
-        printf("The file provided doesn't seem to be a proper bitmap file.\n");
-        fclose(bmp);
-        exit(-337);
+        char *arg = strchr(s, ':');
+        int kind = 0;
+        if(arg)
+            *arg++ = '\0';
+        while(kind <= CH_DECOMPRESS && strcmp(s, names[kind]) != 0)
+            kind++;
+        int takesArg = kind != CH_COMPRESS && kind != CH_ENCDEF 
+                    && kind != CH_DECOMPRESS;
+        if(kind == CH_DECBMP && arg && (arg[strspn(arg, "0123456789")] != '\0' 
+            || strtoull(arg, NULL, 10) > 0xFFFFFFFFULL)) // a byte count
+            takesArg = 0;
+        if(kind > CH_DECOMPRESS || takesArg != (arg && *arg))
+        {
+            printf("Error: %s isn't a chain stage or has the wrong argument.\n", s);
+            return -86;
+        }
+        if(n == CHAIN_MAX)
+        {
+            printf("Error: no more than %d stages, please.\n", CHAIN_MAX);
+            return -86;
+        }
+        st[n].kind = kind;
+        st[n++].arg = arg;
     }
 
-    if(ihead.biBitCount != 24)
+    for(int i = 0; i < n; i++)
     {
-        printf("%s is not a 24-bit bitmap image.\n", fname);
-        fclose(bmp);
-        exit(-262);
+        int kind = st[i].kind;
+        keymaps += kind == CH_ENCDEF;
+        if((kind >= CH_DECBMP) != (st[0].kind >= CH_DECBMP))
+        {
+            printf("Error: a chain either encrypts or decrypts, not both.\n");
+            return -87;
+        }
+        if(((kind == CH_COMPRESS || kind == CH_DECBMP) && i != 0) 
+            || ((kind == CH_ENCBMP || kind == CH_DECOMPRESS) && i != n - 1))
+        {
+            printf("Error: compress and decbmp go first, encbmp and decompress last.\n");
+            return -87;
+        }
     }
-    
-    if(ihead.biCompression != 0)
+    if(n == 0 || keymaps > 1)
     {
-        printf("%s is not an uncompressed bitmap file.\n", fname);
-        fclose(bmp);
-        exit(-546);
+        printf("Error: %s.\n", n == 0 ? "the chain is empty" 
+                : "only one encdef per chain, they would share a keymap");
+        return -87;
     }
+    return n;
+}
 
-    // we got here so everything is ok
-    char *outname = (char *) calloc(strlen(fname) + strlen("decrypted_") + 1, 
-                    sizeof(char));
-    strcpy(outname, "decrypted_");
-    strcat(outname, fname);
+#ifndef _WIN32
+// --chain: every stage is a FILE * wrapped around the next one, so the
+// data goes through all of them in a single pass with no temp files.
+// compress(ion) is the engine (packStream/unpackStream, otherwise
+// xorStream just moves the data), the keyed stages XOR whatever passes
+// through them and the bitmap stages embed into or extract from a bitmap.
+static ssize_t linkWrite(void *cookie, const char *buf, size_t size)
+{
+    CHAINLINK *l = (CHAINLINK *) cookie;
+    size_t done = 0;
 
-    FILE *output = fopen(outname, "wb");
-    if(!output)
+    if(l->isBmp)
+        return bmpPut(&l->bmp, (const uchar8 *) buf, size) == 0 ? (ssize_t) size : 0;
+    while(done < size)
     {
-        printf("Unable to create file for output.\n");
-        fclose(bmp);
-        free(outname);
-        exit(-211);
+        uint32 want = size - done < CHUNK_SIZE ? size - done : CHUNK_SIZE;
+        memcpy(l->buf, buf + done, want);
+        if(keyXor(&l->ks, l->buf, want) != 0 
+            || fwrite(l->buf, 1, want, l->next) != want)
+            return 0;
+        done += want;
+    }
+    return size;
+}
+
+static ssize_t linkRead(void *cookie, char *buf, size_t size)
+{
+    CHAINLINK *l = (CHAINLINK *) cookie;
+    uint32 want = size < CHUNK_SIZE ? size : CHUNK_SIZE;
+
+    if(l->isBmp)
+    {
+        want = want < l->left ? want : l->left;
+        if(bmpGet(&l->bmp, (uchar8 *) buf, want) != 0)
+            return -1;
+        l->left -= want;
+        return want;
     }
+    size_t got = fread(buf, 1, want, l->next);
+    if(ferror(l->next) || keyXor(&l->ks, (uchar8 *) buf, got) != 0)
+        return -1;
+    return got;
+}
 
-    short padding   = (4 - (ihead.biWidth * 3) % 4) % 4;
-    short i = 0;
-    char *wtv;
-    uchar8 byte;
-    uchar8 readybyte;
-    uchar8 bytef[9];
-    uchar8 readybytef[9];
-    readybytef[8] = '\0';
-    bytef[8] = '\0';
-    double general = 0.0;
-    uchar8 pad = 0x0;
-    long int amountx = 0;
+static int linkClose(void *cookie)
+{
+    CHAINLINK *l = (CHAINLINK *) cookie;
+    int error = 0;
 
-    //magic happens here
-    while(amountx < amount*4)
+    if(l->isBmp)
+    {
+        error = bmpClose(&l->bmp, 1) != 0;
+        if(l->count)
+            *l->count = l->bmp.count;
+    }
+    else
     {
-        fread(&byte, 1, 1, bmp);
-        byteFormat(bytef, byte);
+        if(l->ks.keymap && fclose(l->ks.keymap) != 0)
+            error = 1;
+        if(fclose(l->next) != 0) // closes the rest of the chain
+            error = 1;
+    }
+    freeVigKey(&l->ks);
+    bufPut(l->buf, XOR_BLOCK, 1);
+    free(l);
+    return error ? -1 : 0;
+}
 
-        readybytef[i]   = bytef[6];
-        readybytef[i+1] = bytef[7];
-        
-        i += 2;
-        
-        if(i > 7)
+// a keyed stage in front of (writing) or behind (reading) next; a keymap
+// it creates is flagged in made (2), so only that one is cleaned up.
+// size is how much data goes through when reading, a keymap must match it
+static FILE *keyLink(FILE *next, const CHAINSTAGE *st, const char *fname, 
+                    int writing, uint32 size, int *made, int *status)
+{
+    cookie_io_functions_t io = { linkRead, linkWrite, NULL, linkClose };
+    CHAINLINK *l = (CHAINLINK *) calloc(1, sizeof(CHAINLINK));
+    FILE *keyfl;
+
+    l->next = next;
+    if(st->kind == CH_ENCDEF)
+    {
+        char *keyname = keymapName(fname);
+        l->ks.kind = KS_RANDOM;
+        l->ks.keymap = fopen(keyname, "wb");
+        if(!l->ks.keymap)
+        {
+            printf("Error: keymap file couldn't be created.\n");
+            *status = -97;
+        }
+        else
+            *made |= 2;
+        free(keyname);
+    }
+    else if(st->kind == CH_DECDEF)
+    {
+        l->ks.kind = KS_KEYMAP;
+        l->ks.keymap = openInput(st->arg);
+        if(!l->ks.keymap)
+        {
+            printf("Couldn't open keymap file for decryption. Does it exist?\n");
+            *status = -31;
+        }
+        else if(fileSize(l->ks.keymap) != size)
+        {
+            printf("%s%s", 
+            "Error: Your keymap file doesn't belong to your encrypted file.", 
+            "Decryption cannot continue.\n");
+            *status = -42;
+        }
+    }
+    else if(!(keyfl = fopen(st->arg, "rb")))
+    {
+        printf("Error opening your cipher file (%s).\n", st->arg);
+        *status = -29;
+    }
+    else
+    {
+        l->ks.kind = KS_VIG;
+        *status = loadVigKey(&l->ks, keyfl, st->arg);
+        fclose(keyfl);
+        if(*status == 0 && l->ks.vlen == 0)
         {
-            readybyte = (uchar8) strtol(readybytef, &wtv, 2);
-            fwrite(&readybyte, 1, 1, output);
-            i = 0;
+            printf("Your key file (%s) doesn't contain any letters.\n", st->arg);
+            *status = -28;
         }
-        
-        general++;
-        amountx++;
+    }
+
+    if(*status == 0 && !(l->buf = bufGet(XOR_BLOCK, 1)))
+        *status = -79;
+    l->ks.scratch = l->buf ? l->buf + CHUNK_SIZE : NULL;
+    FILE *fl = *status == 0 ? fopencookie(l, writing ? "w" : "r", io) : NULL;
+    if(!fl)
+    {
+        if(l->ks.keymap)
+            fclose(l->ks.keymap);
+        freeVigKey(&l->ks);
+        bufPut(l->buf, XOR_BLOCK, 1);
+        free(l);
+        return NULL;
+    }
+    return fl;
+}
+
+// the embedding end (outname set) or extracting start of a chain
+static FILE *bmpLink(const char *fname, const char *outname, uint32 amount, 
+                    uint32 *count, int *status)
+{
+    cookie_io_functions_t io = { linkRead, linkWrite, NULL, linkClose };
+    CHAINLINK *l = (CHAINLINK *) calloc(1, sizeof(CHAINLINK));
+
+    l->isBmp = 1;
+    l->left = amount;
+    l->count = count;
+    if((*status = openBmp(&l->bmp, fname, outname)) == 0 
+        && !outname && amount > l->bmp.capacity)
+    {
+        printf("The number of bytes to extract is too large.\n");
+        bmpClose(&l->bmp, 0);
+        *status = -355;
+    }
+    FILE *fl = *status == 0 ? fopencookie(l, outname ? "w" : "r", io) : NULL;
+    if(!fl && *status == 0)
+    {
+        bmpClose(&l->bmp, 0);
+        if(outname)
+            remove(outname); // openBmp created it
+        *status = -79;
+    }
+    if(!fl)
+        free(l);
+    return fl;
+}
+
+int runChain(const char *spec, const char *fname, uint32 *embedded)
+{
+    CHAINSTAGE st[CHAIN_MAX];
+    KEYSTREAM none  = { KS_NONE, NULL, NULL, 0, 0, NULL, 0 };
+    char *list      = strdup(spec);
+    int n           = parseChain(list, st);
+    int status      = n < 0 ? n : 0;
+    FILE *in        = NULL;
+    FILE *out       = NULL;
+    FILE *fl;
+    uint32 total    = 0;
+    int made        = 0; // outputs this run created: 1 = outname, 2 = keymap
+
+    if(status == 0 && sodium_init() < 0)
+    {
+        printf("Error initializing sodium.\n");
+        status = -8;
+    }
+    if(status != 0)
+    {
+        free(list);
+        return status;
+    }
 
-        if(general / 3.0 == (double) ihead.biWidth)
+    // the keyed stages are st[first] up to st[end - 1]
+    const int decrypting    = st[0].kind >= CH_DECBMP;
+    const int first         = st[0].kind == CH_COMPRESS || st[0].kind == CH_DECBMP;
+    const int end           = st[n - 1].kind == CH_ENCBMP 
+                            || st[n - 1].kind == CH_DECOMPRESS ? n - 1 : n;
+    char *outname           = decrypting ? prefixName("decrypted_", fname) 
+                            : prefixName("encrypted_", st[n - 1].kind == CH_ENCBMP 
+                                        ? st[n - 1].arg : fname);
+    char *keyname           = keymapName(fname);
+
+    if(!decrypting) // built from the output back to the engine
+    {
+        if(!(in = openRead(fname)))
+        {
+            printf("Error: File not found.\n");
+            status = -98;
+        }
+        else if(st[n - 1].kind == CH_ENCBMP)
+            out = bmpLink(st[n - 1].arg, outname, 0, embedded, &status);
+        else if(!(out = fopen(outname, "wb")))
+        {
+            printf("Error: Encrypted file couldn't be created.\n");
+            status = -97;
+        }
+        if(out)
+            made |= 1;
+        for(int i = end - 1; out && i >= first; i--)
+        {
+            if(!(fl = keyLink(out, &st[i], fname, 1, 0, &made, &status)))
+                fclose(out);
+            out = fl;
+        }
+        if(in)
+            total = fileSize(in);
+    }
+    else // from the input forward to the engine
+    {
+        char *wtv;
+        if(st[0].kind == CH_DECBMP)
+        {
+            total = strtoul(st[0].arg, &wtv, 10);
+            in = bmpLink(fname, NULL, total, NULL, &status);
+        }
+        else if(!(in = openInput(fname)))
+        {
+            printf("Couldn't open file for decryption. Does it exist?\n");
+            status = -32;
+        }
+        else
+            total = fileSize(in);
+        for(int i = first; in && i < end; i++)
+        {
+            if(!(fl = keyLink(in, &st[i], fname, 0, total, &made, &status)))
+                fclose(in);
+            in = fl;
+        }
+        if(in && !(out = fopen(outname, "wb")))
         {
-            fseek(bmp, padding, SEEK_CUR);
-            general = 0.0;
+            printf("Couldn't create decrypted file.\n");
+            status = -30;
         }
+        if(out)
+            made |= 1;
     }
 
-    printf("%ld bytes have been extracted into the file %s.\n", amount, outname);
+    if(in && out)
+    {
+        if(!opts.quiet)
+            printf("Progress: [00.00%%]");
+        fflush(stdout);
+        if(st[0].kind == CH_COMPRESS)
+            status = packStream(in, out, &none, total, NULL);
+        else if(st[n - 1].kind == CH_DECOMPRESS)
+            status = unpackStream(in, out, &none, total, NULL);
+        else
+            status = xorStream(in, out, &none, total, NULL);
+    }
 
+    // closing the outer end of the chain flushes and closes all of it
+    if(in)
+        fclose(in);
+    if(out && fclose(out) != 0 && status == 0)
+        status = -96;
+    // nothing half-done is left around, but only what this run created goes:
+    // an older keymap or output with the same name isn't ours to delete
+    if(status != 0)
+    {
+        if(made & 1)
+            remove(outname);
+        if(made & 2)
+            remove(keyname);
+    }
     free(outname);
-    fclose(output);
-    fclose(bmp);
+    free(keyname);
+    free(list);
+    return status;
 }
-
-void byteFormat(uchar8 *str, uchar8 byte)
+#else
+int runChain(const char *spec, const char *fname, uint32 *embedded)
 {
-    uchar8 temp[9];
-    int j;
-    itoa((int) byte, temp, 2);
-    for(j = 0; j < 8-strlen(temp); j++)
-        str[j] = '0';
-    str[j] = '\0';
-    strcat(str, temp);
+    printf("Error: --chain doesn't work on Windows.\n");
+    return -88;
 }
+#endif